@@ -33,38 +33,35 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <inttypes.h>
 #include <math.h>
 #include <assert.h>
 #include <strings.h>
 
+#include "rX.h"
+#include "rX_sources.h"
+#include "rd_range.h"
+#include "gof.h"
+
 /*
  * Time to think about how to expand this to an arbitrary range.
  */
 
 /*
- * Following two functions are copied from rd.c, see that file
- * for explanation.
+ * rX() comes from rX.h and the function below is copied from rd.c
+ * (where it's called r0to1b), see those files for explanation.
  */
-static uint64_t
-rX(uint64_t X)
-{
-	uint64_t res;
-	assert(X > 0 && X < 65);
-	arc4random_buf(&res, sizeof(res));
-	if (X == 64)
-		return res;
-	return res & ((1ULL << X) - 1);
-}
-
 static double
 r0to1(void)
 {
 	uint64_t r = rX(53);
 	int e = ffsll(r);
 	uint64_t m;
-	if (e > 52 || e == 0)
+	if (e > 52 || e == 0) {
+		RX_STAT_ADD(zeros, 1);
 		return 0.0;
+	}
 	/* Shift out the bit we don't want set. */
 	m = (r >> e) << (e - 1);
 	return ldexp(0x1p52 + m, -52 - e);
@@ -96,7 +93,29 @@ rd_naive(double from, double to)
 
 /*
  * And a test showing why this doesn't work.
+ *
+ * The numbers are counted with gof.h, which tells us how likely the
+ * counts are for a uniform generator (see there). A p-value below
+ * GOF_ALPHA means that something is wrong, with 10^7 numbers per test
+ * even a bias of a fraction of a percent gets there.
  */
+#define GOF_ALPHA 1e-6
+
+static void
+gof_report(const char *name, double from, double to, const struct gof_hist *h)
+{
+	double chi, chip, d, ksp;
+	uint64_t i;
+
+	chip = gof_chisq(h, &chi);
+	ksp = gof_ks(h, &d);
+	for (i = 0; i < h->nbuckets && i < 64; i++)
+		printf("%" PRIu64 ", ", h->count[i]);
+	printf("\n%s(%a, %a): chi-square %.1f (%" PRIu64 " df) p %.3g, KS D %.3g p %.3g\n",
+	    name, from, to, chi, h->nbuckets - 1, chip, d, ksp);
+	if (chip < GOF_ALPHA || ksp < GOF_ALPHA)
+		printf("%s(%a, %a): not uniform\n", name, from, to);
+}
 
 static void
 test_rd_naive(void)
@@ -104,32 +123,20 @@ test_rd_naive(void)
 	int buckets = 3;
 	int attempts = 1000000;
 	double from = 0x1p52, to = from + buckets - 1;
-	int bucket[buckets];
+	struct gof_hist h;
 	int i;
 
-	memset(bucket, 0, sizeof(bucket));
-
 	printf("f: %f, t: %f\n", from, to);
 
+	/* The buckets are the three integers, so [from, from + 3). */
+	gof_hist_init(&h, from, from + buckets, buckets);
 	for (i = 0; i < attempts; i++) {
 		double r = rd_naive(from, to);
-		unsigned int b = (int)(r - from);
 		assert(r >= from && r <= to);
-		assert(b < buckets);
-		bucket[b]++;
-	}
-	int minbucket = attempts, maxbucket = 0;
-	for (i = 0; i < buckets; i++) {
-		if (bucket[i] < minbucket)
-			minbucket = bucket[i];
-		if (bucket[i] > maxbucket)
-			maxbucket = bucket[i];
-		printf("%d\n", bucket[i]);
-	}
-	double diff = (double)maxbucket/(double)minbucket - 1.0;
-	if (diff > 0.001) {
-		printf("rd_naive: very large diff (should be close to 0): %f\n", diff);
+		gof_hist_add1(&h, r);
 	}
+	gof_report("rd_naive", from, to, &h);
+	gof_hist_free(&h);
 }
 
 /*
@@ -179,7 +186,7 @@ test_rd_naive(void)
  */
 
 static uint64_t
-r_uniform(uint64_t upper_bound)
+r_uniform_mod(uint64_t upper_bound)
 {
 	uint64_t r, min;
 
@@ -198,11 +205,156 @@ r_uniform(uint64_t upper_bound)
 		r = rX(64);
 		if (r >= min)
 			break;
+		RX_STAT_ADD(rejections, 1);
 	}
 
 	return r % upper_bound;
 }
 
+/*
+ * That works, but it does two 64 bit divisions for every number we
+ * generate: one to find the threshold and one to reduce the result.
+ * A 64 bit division is a very slow instruction and it sits right in
+ * the middle of every rd_positive below.
+ *
+ * Daniel Lemire's "Fast Random Integer Generation in an Interval"
+ * maps the random number to the range with a multiplication instead.
+ * Multiply a 64 bit random number r by upper_bound and the high 64
+ * bits of the 128 bit product are in [0, upper_bound). Every one of
+ * those results is hit by either floor(2^64 / upper_bound) or one more
+ * values of r, and which r get the extra hits can be seen in the low
+ * 64 bits of the product: those that are less than
+ * 2^64 % upper_bound. Reject those and every result has the same
+ * number of r mapping to it, just like above.
+ *
+ * The trick is that 2^64 % upper_bound < upper_bound, so if the low
+ * bits are at least upper_bound we know we can't reject without
+ * computing the threshold. Only when they aren't do we need the
+ * division, and that happens with probability upper_bound / 2^64,
+ * which is at most 2^-11 for the counts up to 2^53 we need here.
+ *
+ * When upper_bound is a power of two 2^b there is nothing to reject
+ * and all of the above boils down to the top b bits of the random
+ * number, so just ask rX() for b bits. That's every binade, [0,1) and
+ * [0,2^53), so quite common, it costs no multiplication and no loop,
+ * and it uses only the bits it needs, 53 instead of 64 for [0,1),
+ * just like r0to1b.
+ *
+ * That's r_uniform() in rd_range.h.
+ */
+
+/*
+ * Check that both versions give us something that at least looks
+ * uniform. 3 * 2^62 is a bound where r_uniform_mod without the
+ * rejection would make the lowest third of the range twice as likely
+ * as the rest.
+ */
+static void
+test_r_uniform_n(uint64_t (*fn)(uint64_t), const char *name, uint64_t upper_bound, int buckets)
+{
+	int attempts = 3000000;
+	uint64_t bucket[buckets];
+	uint64_t minbucket = attempts, maxbucket = 0;
+	int i;
+
+	memset(bucket, 0, sizeof(bucket));
+
+	for (i = 0; i < attempts; i++) {
+		uint64_t r = fn(upper_bound);
+		assert(r < upper_bound);
+		bucket[(unsigned __int128)r * buckets / upper_bound]++;
+	}
+	for (i = 0; i < buckets; i++) {
+		if (bucket[i] < minbucket)
+			minbucket = bucket[i];
+		if (bucket[i] > maxbucket)
+			maxbucket = bucket[i];
+	}
+	double diff = (double)maxbucket/(double)minbucket - 1.0;
+	if (diff > 0.05) {
+		printf("%s(%" PRIu64 "): very large diff (should be close to 0): %f\n",
+		    name, upper_bound, diff);
+	}
+}
+
+static void
+test_r_uniform(void)
+{
+	const uint64_t bounds[] = { 2, 3, 7, 1000, (1ULL << 53) - 1, 1ULL << 53, 3ULL << 62 };
+	unsigned i;
+
+	for (i = 0; i < sizeof(bounds) / sizeof(bounds[0]); i++) {
+		int buckets = bounds[i] < 17 ? bounds[i] : 17;
+
+		test_r_uniform_n(r_uniform_mod, "r_uniform_mod", bounds[i], buckets);
+		test_r_uniform_n(r_uniform, "r_uniform", bounds[i], buckets);
+	}
+	assert(r_uniform(0) == 0 && r_uniform(1) == 0);
+}
+
+/*
+ * r_uniform_fill in rd_range.h generates lots of numbers with the
+ * same bound without branches. It has to give exactly the same
+ * numbers as r_uniform from the same bits, also for bounds that reject
+ * a lot and when the draws straddle the refills at odd offsets.
+ */
+static void
+test_r_uniform_fill_kernel(r_uniform_kernel kernel, const char *name)
+{
+	const uint64_t bounds[] = { 2, 3, 1000, (1ULL << 53) - 1, 1ULL << 53, 3ULL << 62,
+	    (1ULL << 63) + 1 };
+	const uint32_t key[8] = { 0x66696c6c };
+	static uint64_t a[10007];
+	struct rx_chacha c;
+	uint64_t next;
+	unsigned b;
+	size_t n, i;
+
+	for (b = 0; b < sizeof(bounds) / sizeof(bounds[0]); b++) {
+		uint64_t ub = bounds[b];
+
+		for (n = 1; n < 10007; n = n * 3 + 1) {
+			rx_chacha_init(&c, key, n, 8);
+			rX_source(rx_chacha_fill, &c);
+			rX(n % 64 + 1);
+			/* Powers of two don't get to the kernels. */
+			if ((ub & (ub - 1)) == 0)
+				r_uniform_fill(ub, a, n);
+			else
+				r_uniform_fill_kernel(kernel, ub, -ub % ub, a, n);
+			next = rX(64);
+			rx_chacha_init(&c, key, n, 8);
+			rX_source(rx_chacha_fill, &c);
+			rX(n % 64 + 1);
+			for (i = 0; i < n; i++) {
+				uint64_t r = r_uniform(ub);
+				if (a[i] != r) {
+					printf("r_uniform_fill(%s, %" PRIu64 ")[%zu]: %" PRIu64
+					    ", r_uniform: %" PRIu64 "\n", name, ub, i, a[i], r);
+					abort();
+				}
+			}
+			/* And both have used the same bits. */
+			assert(rX(64) == next);
+		}
+	}
+	rX_source(rx_arc4random_fill, NULL);
+}
+
+static void
+test_r_uniform_fill(void)
+{
+	uint64_t z[3] = { 1, 1, 1 };
+
+	test_r_uniform_fill_kernel(r_uniform_kernel_scalar, "scalar");
+#if defined(__x86_64__) && defined(__GNUC__)
+	if (__builtin_cpu_supports("avx512f"))
+		test_r_uniform_fill_kernel(r_uniform_kernel_avx512, "avx512");
+#endif
+	r_uniform_fill(1, z, 3);
+	assert(z[0] == 0 && z[1] == 0 && z[2] == 0);
+}
+
 /*
  * Now we just need to count our pigeonholes.
  *
@@ -220,30 +372,46 @@ r_uniform(uint64_t upper_bound)
  * exponent.
  *
  * The C standard gives us a tool for this exact purpose: nextafter.
+ * The step is to - nextafter(to, from), and then the count used to be:
+ *
+ *	double count = (to - from) / step;
+ *
+ * with the comment "Leap of faith, I actually don't know if this will
+ * always be correct". It wasn't. verify_ranges.c tried it on every
+ * pair of exponents and when from isn't a multiple of the step (for
+ * example when from is in a lower binade than to), to - from gets
+ * rounded. Sometimes the count comes out as 3602879701896396.5 (that's
+ * numbers_between(0.3, 0.7)) and sometimes as an integer that's off by
+ * one. Worse, from + k * step isn't exactly representable either, so
+ * it gets rounded too, and round-to-even can send two different k to
+ * the same number, or send the last one to `to`.
+ *
+ * So the numbers we generate are the multiples of step in [from, to),
+ * just like rd_any does below for negative numbers. When from is a
+ * multiple of the step those are the same numbers as before, and when
+ * it isn't, from itself isn't one of them, but every one of them is
+ * exactly representable and equally far from its neighbours.
+ *
+ * And then the counting doesn't need any floating point at all. Every
+ * positive double is m * 2^e, where for the exponent field E and the
+ * mantissa field M:
+ *
+ *	m = M + (E ? 2^52 : 0), e = max(E, 1) - 1075
+ *
+ * nextafter(to, from) is the double with the bits of `to` minus one
+ * and the step is its ulp, 2^s with s = e(to - 1). `to` is a multiple
+ * of the step (m(to) << (e(to) - s), and e(to) - s is 0 or 1) and
+ * from / step rounded up is m(from) >> (s - e(from)), plus one if any
+ * bits were shifted out. The count is the difference of the two. It's
+ * shifts, masks and a subtraction, and it's exact by construction.
+ * That's rd_range_count() in rd_range.h.
  */
 static uint64_t
 numbers_between(double from, double to)
 {
-	assert(from >= 0 && to > 0 && from < to);	/* positive numbers for now. */
-	double nxt = nextafter(to, from);		/* next representable number from "to" in the direction of "from" */
-	double step = to - nxt;				/* step between the numbers. */
-	double count = (to - from) / step;		/* Leap of faith, I actually don't know if this will always be correct. */
-	uint64_t r = count;
-
-	/*
-	 * The conversion to uint64_t should be accurate. Every
-	 * integer between 0 and 2^53 can be expressed in a double and
-	 * we can't get a higher count than 2^53 because that's the
-	 * count we get when to is at the end of a range.
-	 *
-	 * As far as I can see we can only get a higher count when we
-	 * extend this to negative ranges because then the count can
-	 * become 2^54 in the worst case. We'll cross that bridge when
-	 * we get there.
-	 */
-	assert((double)r == count);
+	double step, start;
 
-	return r;
+	return rd_range_count(from, to, &step, &start);
 }
 
 /*
@@ -286,23 +454,27 @@ test_ranges(void)
 	 */
 	r = numbers_between(0, 1);
 	assert(r == (1LL << 53));
+
+	/* The ones the leap of faith got wrong. */
+	r = numbers_between(0.3, 0.7);
+	assert(r == 3602879701896396);
+	r = numbers_between(0x1.8p-53, 1);
+	assert(r == (1LL << 53) - 2);
+	r = numbers_between(0x1p-1074, 0x1.0000000000001p-1021);
+	assert(r == (1LL << 52));
+	/* Way below the step, but not 0. */
+	r = numbers_between(0x1p-1074, 0x1p1000);
+	assert(r == (1LL << 53) - 1);
+	r = numbers_between(0, 0x1p-1074);
+	assert(r == 1);
+	r = numbers_between(-0.0, 0x1p-1022);
+	assert(r == (1LL << 52));
 }
 
 /*
  * So the function that works for positive numbers should be
- * relatively trivial:
+ * relatively trivial. That's rd_positive() in rd_range.h.
  */
-static double
-rd_positive(double from, double to)
-{
-	assert(from >= 0 && to > 0 && from < to);	/* positive numbers for now. */
-	double nxt = nextafter(to, from);		/* next representable number from "to" in the direction of "from" */
-	double step = to - nxt;				/* step between the numbers. */
-	double count = (to - from) / step;		/* Leap of faith, I actually don't know if this will always be correct. */
-
-	assert(count <= (1LL << 53));
-	return from + (double)(r_uniform((uint64_t)count)) * step;
-}
 
 /*
  * And a test that things at least appear to make sense. 
@@ -312,35 +484,24 @@ test_rd_positive_n(int buckets)
 {
 	int attempts = 10000000;
 	double from = 0x1p52, to = from + buckets;
-	int bucket[buckets];
-	int i;
-
-	memset(bucket, 0, sizeof(bucket));
+	double r[GOF_BATCH];
+	struct gof_hist h;
+	int i, j;
 
 	printf("f: %f, t: %f\n", from, to);
 
-	for (i = 0; i < attempts; i++) {
-		double r = rd_positive(from, to);
-		unsigned int b = (int)(r - from);
-		if (r < from || r > to)
-			printf("BAD: %f\n", r);
-		assert(r >= from && r <= to);
-		assert(b < buckets);
-		bucket[b]++;
-	}
-	int minbucket = attempts, maxbucket = 0;
-	for (i = 0; i < buckets; i++) {
-		if (bucket[i] < minbucket)
-			minbucket = bucket[i];
-		if (bucket[i] > maxbucket)
-			maxbucket = bucket[i];
-		printf("%d, ", bucket[i]);
-	}
-	printf("\n");
-	double diff = (double)maxbucket/(double)minbucket - 1.0;
-	if (diff > 0.05) {
-		printf("rd_positive: very large diff (should be close to 0): %f (%d %d)\n", diff, maxbucket, minbucket);
+	gof_hist_init(&h, from, to, buckets);
+	for (i = 0; i < attempts; i += GOF_BATCH) {
+		for (j = 0; j < GOF_BATCH; j++) {
+			r[j] = rd_positive(from, to);
+			if (r[j] < from || r[j] >= to)
+				printf("BAD: %f\n", r[j]);
+			assert(r[j] >= from && r[j] < to);
+		}
+		gof_hist_add(&h, r, GOF_BATCH);
 	}
+	gof_report("rd_positive", from, to, &h);
+	gof_hist_free(&h);
 }
 
 static void
@@ -353,6 +514,301 @@ test_rd_positive(void)
 	test_rd_positive_n(42);
 }
 
+/*
+ * rd_positive counts the numbers in the range every time, and r_uniform
+ * might do a division for the threshold.
+ * But when we generate lots of numbers it's almost always from the
+ * same range, so all of that can be done once up front, like the
+ * param_type of a C++ distribution. That's struct rd_range in
+ * rd_range.h, it lives there so that other programs can use it.
+ */
+
+/*
+ * A prepared range must give us exactly what rd_positive gives us
+ * from the same random bits.
+ */
+static void
+test_rd_range(void)
+{
+	const double ranges[][2] = {
+		{ 0x1p52, 0x1p52 + 3 }, { 0x1p55, 0x1p55 + 25 },
+		{ 0, 0x1p52 + 1000 }, { 3, 0x1p52 + 1000 }, { 0, 0x1p53 + 2 },
+		{ 0, 1 }, { 0.1, 0.7 }, { 1, 2 }, { 1, 0x1p0 + 0x1p-52 },
+	};
+	const uint32_t key[8] = { 0x72616e67, 0x65 };
+	struct rx_chacha c;
+	struct rd_range rr;
+	unsigned i, j;
+
+	for (i = 0; i < sizeof(ranges) / sizeof(ranges[0]); i++) {
+		double from = ranges[i][0], to = ranges[i][1];
+		double a[1000], f[1000];
+
+		rd_range_init(&rr, from, to);
+		assert(rr.count == numbers_between(from, to));
+		assert(rr.bits == 0 || rr.count == 1ULL << rr.bits);
+
+		rx_chacha_init(&c, key, i, 8);
+		rX_source(rx_chacha_fill, &c);
+		for (j = 0; j < 1000; j++)
+			a[j] = rd_positive(from, to);
+		rx_chacha_init(&c, key, i, 8);
+		rX_source(rx_chacha_fill, &c);
+		for (j = 0; j < 1000; j++) {
+			double b = rd_range_draw(&rr);
+			if (a[j] != b) {
+				printf("rd_range(%a, %a)[%u]: %a, rd_positive: %a\n",
+				    from, to, j, b, a[j]);
+				abort();
+			}
+			assert(b >= from && b < to);
+		}
+		rx_chacha_init(&c, key, i, 8);
+		rX_source(rx_chacha_fill, &c);
+		rd_range_fill(&rr, f, 1000);
+		if (memcmp(a, f, sizeof(a))) {
+			printf("rd_range_fill(%a, %a) differs from rd_positive\n", from, to);
+			abort();
+		}
+	}
+
+	/* The power of two ranges take only the bits they need. */
+	rd_range_init(&rr, 0, 1);
+	assert(rr.bits == 53);
+	rd_range_init(&rr, 1, 2);
+	assert(rr.bits == 52);
+	rd_range_init(&rr, 0x1p52, 0x1p52 + 3);
+	assert(rr.bits == 0);
+	rx_chacha_init(&c, key, 0, 8);
+	rX_source(rx_chacha_fill, &c);
+	rX(1);
+	i = rx_res.pos;
+	rd_range_draw(&rr);
+	rd_range_init(&rr, 0, 1);
+	j = rx_res.pos;
+	rd_range_draw(&rr);
+	assert(j - i >= 64 && rx_res.pos - j == 53);
+	rX_source(rx_arc4random_fill, NULL);
+}
+
+/*
+ * rd_range_sample picks k different numbers. In a range with 5
+ * numbers there are 10 ways to pick 3 of them and all of them should
+ * be equally likely, and asking for all of the numbers should give us
+ * all of them. It should also be Floyd's algorithm with exactly the
+ * numbers r_uniform would give, power of two bounds and the bound 1
+ * included.
+ */
+static void
+test_rd_range_sample(void)
+{
+	const uint32_t key[8] = { 0x666c6f79, 0x64 };
+	static double big[100000];
+	double s[5], f[12];
+	uint64_t picked[12], t;
+	struct rx_chacha c;
+	struct rd_range rr;
+	struct gof_hist h;
+	int i, j, id;
+
+	rd_range_init(&rr, 0x1p52, 0x1p52 + 12);
+	for (i = 1; i <= 12; i++) {
+		rx_chacha_init(&c, key, i, 8);
+		rX_source(rx_chacha_fill, &c);
+		for (j = 12 - i; j < 12; j++) {
+			t = r_uniform(j + 1);
+			for (id = 0; id < j - (12 - i); id++)
+				if (picked[id] == t)
+					t = j;
+			picked[j - (12 - i)] = t;
+		}
+		rx_chacha_init(&c, key, i, 8);
+		rX_source(rx_chacha_fill, &c);
+		assert(rd_range_sample(&rr, f, i, 0) == 0);
+		for (j = 0; j < i; j++)
+			assert(f[j] == 0x1p52 + picked[j]);
+	}
+	rX_source(rx_arc4random_fill, NULL);
+
+	rd_range_init(&rr, 0x1p52, 0x1p52 + 5);
+	assert(rd_range_sample(&rr, s, 6, 0) == -1);
+	assert(rd_range_sample(&rr, s, 5, 1) == 0);
+	for (j = 0; j < 5; j++)
+		assert(s[j] == 0x1p52 + j);
+
+	gof_hist_init(&h, 0, 32, 32);
+	for (i = 0; i < 1000000; i++) {
+		rd_range_sample(&rr, s, 3, 0);
+		for (id = 0, j = 0; j < 3; j++) {
+			assert(s[j] >= 0x1p52 && s[j] < 0x1p52 + 5);
+			assert(!(id & (1 << (int)(s[j] - 0x1p52))));
+			id |= 1 << (int)(s[j] - 0x1p52);
+		}
+		gof_hist_add1(&h, id);
+	}
+	/* Only the 10 subsets, as buckets of their own. */
+	for (i = 0, j = 0; i < 32; i++)
+		if (__builtin_popcount(i) == 3)
+			h.count[j++] = h.count[i];
+	h.nbuckets = 10;
+	gof_report("rd_range_sample", 0x1p52, 0x1p52 + 5, &h);
+	h.nbuckets = 32;
+	gof_hist_free(&h);
+
+	rd_range_init(&rr, 0.0, 1.0);
+	assert(rd_range_sample(&rr, big, 100000, 1) == 0);
+	for (j = 1; j < 100000; j++)
+		assert(big[j - 1] < big[j] && big[j] < 1.0);
+	/* Almost all of a small range. */
+	rd_range_init(&rr, 1.0, 1.0 + 100000 * 0x1p-52);
+	assert(rd_range_sample(&rr, big, 99999, 1) == 0);
+	for (j = 1; j < 99999; j++)
+		assert(big[j - 1] < big[j]);
+}
+
+/*
+ * Time to tackle negative numbers.
+ *
+ * A range that is entirely negative is the mirror image of a positive
+ * range, except that the end with the biggest absolute value is from
+ * and not to. So the step is the distance from `from` to the next
+ * number towards zero, and since the biggest numbers are now at the
+ * inclusive end we start counting from there.
+ *
+ * A range that crosses zero has numbers with two different biggest
+ * absolute values, one on each side of zero, and the step has to be
+ * the bigger of the two steps. That brings us the bridge mentioned in
+ * numbers_between: each side of zero can have up to 2^53 numbers, so
+ * the count can be up to 2^54. Luckily r_uniform doesn't care.
+ *
+ * There's one more catch. When the bigger step comes from `to`, then
+ * `from` might not be a multiple of the step, and then from + k * step
+ * would have to be rounded for some k. Instead of rounding the numbers
+ * we generate are the multiples of step in [from, to), so all of them
+ * are exactly representable. That also means that we can do all the
+ * counting in integers:
+ *
+ *	first = ceil(from / step), last = ceil(to / step)
+ *
+ * (dividing by a power of two is exact, unless the quotient is too
+ * small to be a normal number, see below) and the result is
+ * (first + r_uniform(last - first)) * step. first + k is at most 2^53
+ * in absolute value, so it converts to double without rounding. We
+ * can't compute from + k * step directly, because k can be bigger than
+ * 2^53 and then k itself isn't exact as a double.
+ *
+ * When from is a multiple of step (always the case when the range
+ * is entirely negative) these are exactly the numbers from + k * step.
+ * rd_positive generates the multiples of step too, see numbers_between.
+ */
+static uint64_t
+numbers_between_any(double from, double to, double *stepp, int64_t *firstp)
+{
+	double step;
+	int64_t first, last;
+
+	assert(from < 0 && from < to);
+	step = nextafter(from, 0) - from;
+	if (to > 0 && to - nextafter(to, 0) > step)
+		step = to - nextafter(to, 0);
+	first = ceil(from / step);
+	/*
+	 * A tiny to and a huge step can underflow to / step to 0, but
+	 * then 0 is in the range and last has to be 1. A negative
+	 * quotient that underflows rounds up to 0 anyway, so first is
+	 * fine.
+	 */
+	last = ceil(to / step) + (to > 0 && to / step == 0);
+
+	*stepp = step;
+	*firstp = first;
+	return last - first;
+}
+
+/*
+ * Positive ranges take the same path as rd_positive, so they cost the
+ * same.
+ */
+static double
+rd_any(double from, double to)
+{
+	double step;
+	int64_t first;
+	uint64_t count;
+
+	if (from >= 0)
+		return rd_positive(from, to);
+
+	count = numbers_between_any(from, to, &step, &first);
+	return (double)(first + (int64_t)r_uniform(count)) * step;
+}
+
+static void
+test_ranges_any(void)
+{
+	double step;
+	int64_t first;
+	uint64_t r;
+
+	r = numbers_between_any(-0x1p52 - 3, -0x1p52, &step, &first);
+	assert(r == 3 && step == 1.0);
+	r = numbers_between_any(-4, -2, &step, &first);
+	assert(r == (1LL << 52) && step == 0x1p-51);
+	/* The mirror image of numbers_between(0, 1). */
+	r = numbers_between_any(-1, 0, &step, &first);
+	assert(r == (1LL << 53));
+	r = numbers_between_any(-1, -0.0, &step, &first);
+	assert(r == (1LL << 53));
+	/* Both sides have 2^53 numbers. */
+	r = numbers_between_any(-1, 1, &step, &first);
+	assert(r == (1LL << 54) && step == 0x1p-53);
+	r = numbers_between_any(-3.5, 12.0, &step, &first);
+	assert(r == 31LL << 48 && step == 0x1p-49);
+	/* -0.1 isn't a multiple of 2^-52, so it's not one of the numbers. */
+	r = numbers_between_any(-0.1, 2.0, &step, &first);
+	assert(step == 0x1p-52 && first * step > -0.1);
+	assert(r == (uint64_t)floor(0.1 * 0x1p52) + (1ULL << 53));
+	r = numbers_between_any(-0x1p-1074, 0x1p-1074, &step, &first);
+	assert(r == 2);
+	/* 0x1p-1074 / 0x1p947 underflows, 0 still has to be counted. */
+	r = numbers_between_any(-0x1p1000, 0x1p-1074, &step, &first);
+	assert(step == 0x1p947 && first == -(1LL << 53) && r == (1ULL << 53) + 1);
+}
+
+/*
+ * Same kind of bucket test as test_rd_positive_n, around zero.
+ */
+static void
+test_rd_any_n(double from, double to, int buckets)
+{
+	int attempts = 3000000;
+	struct gof_hist h;
+	int i;
+
+	gof_hist_init(&h, from, to, buckets);
+	for (i = 0; i < attempts; i++) {
+		double r = rd_any(from, to);
+		if (r < from || r >= to) {
+			printf("rd_any(%a, %a) BAD: %a\n", from, to, r);
+			abort();
+		}
+		gof_hist_add1(&h, r);
+	}
+	gof_report("rd_any", from, to, &h);
+	gof_hist_free(&h);
+}
+
+static void
+test_rd_any(void)
+{
+	test_rd_any_n(-1, 1, 2);
+	test_rd_any_n(-3, 4, 7);
+	test_rd_any_n(-3.5, 12.0, 31);
+	test_rd_any_n(-0x1p52 - 4, -0x1p52, 4);
+	test_rd_any_n(-0x1p52, 0x1p52, 16);
+	test_rd_any_n(0x1p52, 0x1p52 + 3, 3);
+}
+
 /*
  * And the last test, from rd.c, check that rd_positive(0,1) is equivalent to r0to1b.
  */
@@ -487,12 +943,56 @@ test_rd_positive0to1(void)
  * same results.
  */
 
+/*
+ * With -DRX_STATS, check that the counters add up. r_uniform(3 * 2^62)
+ * rejects a quarter of the time, so there is a third of a rejection
+ * per number, and every round costs 64 bits. The bulk fills and
+ * switching the source don't go through rX(), but they move the
+ * position in the reservoir and that's what is counted.
+ */
+static void
+test_stats(void)
+{
+#ifdef RX_STATS
+	static uint64_t buf[100000];
+	struct rx_stats a, b;
+	uint64_t i, n = 1000000, rej, left;
+
+	rx_stats_snapshot(&a);
+	for (i = 0; i < n; i++)
+		r_uniform(3ULL << 62);
+	rx_stats_snapshot(&b);
+	rej = b.rejections - a.rejections;
+	assert(b.bits_requested - a.bits_requested == (n + rej) * 64);
+	assert(rej > n * 3 / 10 && rej < n * 4 / 10);
+
+	rx_stats_snapshot(&a);
+	r_uniform_fill(1 << 10, buf, 100000);
+	left = RX_BITS - rx_res.pos;
+	rX_source(rx_arc4random_fill, NULL);
+	rX(7);
+	rx_stats_snapshot(&b);
+	assert(b.bits_requested - a.bits_requested == 100000 * 10 + 7);
+	assert(b.bits_discarded - a.bits_discarded == left);
+	printf("stats: %" PRIu64 " bits, %" PRIu64 " refills, %" PRIu64
+	    " rejections, %" PRIu64 " zeros\n", b.bits_requested, b.refills,
+	    b.rejections, b.zeros);
+#endif
+}
+
 int
 main(int argc, char **argv)
 {
 	test_rd_naive();
+	test_r_uniform();
+	test_r_uniform_fill();
 	test_ranges();
 	test_rd_positive();
+	test_rd_range();
+	test_rd_range_sample();
+	test_ranges_any();
+	test_rd_any();
 	test_rd_positive0to1();
+	test_stats();
 	return 0;
 }
@@ -0,0 +1,330 @@
+/*
+ * Copyright (c) 2015 Artur Grabowski <art@blahonga.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * g++ 12 thinks that __Y in avx512fintrin.h may be used uninitialized
+ * when it inlines the AVX-512 kernels from the headers. That's its
+ * own _mm512_undefined_*() and not anything here, so shut it up.
+ */
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+
+#include <random>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <math.h>
+#include <assert.h>
+#include <strings.h>
+#include <time.h>
+
+#include "rX.h"
+#include "rX_sources.h"
+#include "r0to1.h"
+#include "rd_range.h"
+#include "exact_urd.hxx"
+#include "ziggurat.h"
+
+/*
+ * How fast is all of this?
+ *
+ * For every generator: nanoseconds per number, numbers per second
+ * and how many random bits each number consumed, both when generating
+ * one number at a time and when filling an array. The ranges include
+ * the ones from test_ranges() in arbitrary_range.c. The results are
+ * written as JSON to stdout so that runs can be compared.
+ *
+ *	bench [arc4random|chacha8|chacha20|philox|aes] > bench.json
+ *
+ * The default source is chacha8 because `arc4random_buf` measures the
+ * operating system more than it measures the code here.
+ */
+
+/*
+ * r1to2, r1to2bis and r0to1 are the versions that rd.c explains on
+ * its way to r0to1b. rd.c is a program and not a header, so they are
+ * copied from there. Everything else comes from the headers, a single
+ * r0to1b is r0to1b_bits(rX(53)).
+ */
+static double
+r1to2(void)
+{
+	return ldexp(0x1p52 + rX(52), 0) / 0x1p52;
+}
+
+static double
+r1to2bis(void)
+{
+	return ldexp(0x1p52 + rX(52), -52);
+}
+
+static double
+r0to1(void)
+{
+	int e;
+	uint64_t m;
+
+	e = ffsll(rX(52));
+	if (e == 0) {
+		RX_STAT_ADD(zeros, 1);
+		return 0.0;
+	}
+	m = rX(52 - e + 1) << (e - 1);
+	return ldexp(0x1p52 + m, -52 - e);
+}
+
+static double
+rd_naive(double from, double to)
+{
+	return (to - from) * r0to1b_bits(rX(53)) + from;
+}
+
+/*
+ * Count the bits consumed by counting refills of the reservoir.
+ */
+static struct {
+	void (*fill)(void *, uint64_t *, size_t);
+	void *arg;
+	uint64_t refills;
+} counted;
+
+static void
+counted_fill(void *arg, uint64_t *buf, size_t n)
+{
+	(void)arg;
+	counted.refills++;
+	counted.fill(counted.arg, buf, n);
+}
+
+static uint64_t
+bits_used(void)
+{
+	return counted.refills * RX_BITS + rx_res.pos;
+}
+
+/*
+ * And the engine calls for the C++ distributions.
+ */
+struct counting_engine {
+	typedef uint64_t result_type;
+	static constexpr result_type min() { return std::mt19937_64::min(); }
+	static constexpr result_type max() { return std::mt19937_64::max(); }
+	result_type operator()() { calls++; return gen(); }
+
+	std::mt19937_64 gen;
+	uint64_t calls = 0;
+};
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+#define NUMBERS (1 << 22)
+#define BULK 4096
+
+static double sink;
+static double bulk[BULK];
+static int first_result = 1;
+
+static void
+report(const char *name, const char *mode, double from, double to, double t, double bits)
+{
+	printf("%s    {\"name\": \"%s\", \"mode\": \"%s\", \"from\": \"%a\", \"to\": \"%a\", "
+	    "\"ns_per_value\": %.3f, \"values_per_sec\": %.0f, \"bits_per_value\": %.2f}",
+	    first_result ? "" : ",\n", name, mode, from, to,
+	    t * 1e9 / NUMBERS, NUMBERS / t, bits / NUMBERS);
+	first_result = 0;
+}
+
+/*
+ * Best of three runs for everything, the first run also warms up the
+ * caches and the branch predictors. `bits` is an expression that
+ * counts the random bits used so far.
+ */
+#define BENCH(name, mode, from, to, bits, body) do {			\
+	double best = 1e9, used = 0;					\
+	int run;							\
+	for (run = 0; run < 3; run++) {					\
+		uint64_t b0 = (bits);					\
+		double t = now();					\
+		body;							\
+		t = now() - t;						\
+		if (t < best)						\
+			best = t;					\
+		used = (bits) - b0;					\
+	}								\
+	report(name, mode, from, to, best, used);			\
+} while (0)
+
+#define SINGLE(name, from, to, bits, expr)				\
+	BENCH(name, "single", from, to, bits,				\
+	    for (int i = 0; i < NUMBERS; i++) sink += (expr))
+
+#define BULKLOOP(name, from, to, bits, expr)				\
+	BENCH(name, "bulk", from, to, bits,				\
+	    for (int i = 0; i < NUMBERS; i += BULK) {			\
+		for (int j = 0; j < BULK; j++)				\
+			bulk[j] = (expr);				\
+		sink += bulk[BULK - 1];					\
+	    })
+
+static void
+bench_0to1(void)
+{
+	SINGLE("r1to2", 1.0, 2.0, bits_used(), r1to2());
+	SINGLE("r1to2bis", 1.0, 2.0, bits_used(), r1to2bis());
+	SINGLE("r0to1", 0.0, 1.0, bits_used(), r0to1());
+	SINGLE("r0to1b", 0.0, 1.0, bits_used(), r0to1b_bits(rX(53)));
+	BULKLOOP("r0to1b", 0.0, 1.0, bits_used(), r0to1b_bits(rX(53)));
+	BENCH("r0to1b_fill", "bulk", 0.0, 1.0, bits_used(),
+	    for (int i = 0; i < NUMBERS; i += BULK) {
+		r0to1b_fill(bulk, BULK);
+		sink += bulk[BULK - 1];
+	    });
+}
+
+static void
+bench_range(double from, double to)
+{
+	struct rd_range rr;
+	counting_engine gen;
+	std::uniform_real_distribution<double> urd(from, to);
+	exact_uniform_real_distribution<double> eurd(from, to);
+
+	rd_range_init(&rr, from, to);
+
+	SINGLE("rd_naive", from, to, bits_used(), rd_naive(from, to));
+	BULKLOOP("rd_naive", from, to, bits_used(), rd_naive(from, to));
+	SINGLE("rd_positive", from, to, bits_used(), rd_positive(from, to));
+	BULKLOOP("rd_positive", from, to, bits_used(), rd_positive(from, to));
+	SINGLE("rd_range", from, to, bits_used(), rd_range_draw(&rr));
+	BENCH("rd_range_fill", "bulk", from, to, bits_used(),
+	    for (int i = 0; i < NUMBERS; i += BULK) {
+		rd_range_fill(&rr, bulk, BULK);
+		sink += bulk[BULK - 1];
+	    });
+
+	/*
+	 * The C++ distributions don't use rX() at all, they get their
+	 * bits from mt19937_64, 64 bits per call.
+	 */
+	SINGLE("std::uniform_real_distribution", from, to, gen.calls * 64, urd(gen));
+	BULKLOOP("std::uniform_real_distribution", from, to, gen.calls * 64, urd(gen));
+	SINGLE("exact_uniform_real_distribution", from, to, gen.calls * 64, eurd(gen));
+	BULKLOOP("exact_uniform_real_distribution", from, to, gen.calls * 64, eurd(gen));
+}
+
+/*
+ * Box-Muller with r0to1b is what most people would do, so that's the
+ * baseline for the ziggurat. The second number of the pair is thrown
+ * away, std::normal_distribution keeps it for the next call.
+ */
+static double
+box_muller(void)
+{
+	double u = r0to1b_bits(rX(53));
+
+	return sqrt(-2.0 * log1p(-u)) * cos(2 * M_PI * r0to1b_bits(rX(53)));
+}
+
+static void
+bench_ziggurat(void)
+{
+	counting_engine gen;
+	std::normal_distribution<double> nd;
+	std::exponential_distribution<double> ed;
+
+	SINGLE("box_muller", -INFINITY, INFINITY, bits_used(), box_muller());
+	SINGLE("rd_normal", -INFINITY, INFINITY, bits_used(), rd_normal());
+	BULKLOOP("rd_normal", -INFINITY, INFINITY, bits_used(), rd_normal());
+	BENCH("rd_normal_fill", "bulk", -INFINITY, INFINITY, bits_used(),
+	    for (int i = 0; i < NUMBERS; i += BULK) {
+		rd_normal_fill(bulk, BULK);
+		sink += bulk[BULK - 1];
+	    });
+	SINGLE("std::normal_distribution", -INFINITY, INFINITY, gen.calls * 64, nd(gen));
+	BULKLOOP("std::normal_distribution", -INFINITY, INFINITY, gen.calls * 64, nd(gen));
+
+	SINGLE("rd_exponential", 0.0, INFINITY, bits_used(), rd_exponential());
+	BULKLOOP("rd_exponential", 0.0, INFINITY, bits_used(), rd_exponential());
+	BENCH("rd_exponential_fill", "bulk", 0.0, INFINITY, bits_used(),
+	    for (int i = 0; i < NUMBERS; i += BULK) {
+		rd_exponential_fill(bulk, BULK);
+		sink += bulk[BULK - 1];
+	    });
+	SINGLE("std::exponential_distribution", 0.0, INFINITY, gen.calls * 64, ed(gen));
+	BULKLOOP("std::exponential_distribution", 0.0, INFINITY, gen.calls * 64, ed(gen));
+}
+
+int
+main(int argc, char **argv)
+{
+	static const double ranges[][2] = {
+		{ 0.0, 1.0 }, { 1.0, 2.0 }, { 0.1, 0.7 },
+		{ 0x1p52, 0x1p52 + 3 }, { 0x1p55, 0x1p55 + 25 },
+		{ 0.0, 0x1p52 + 1000 }, { 0.0, 0x1p53 }, { 0.0, 0x1p53 + 2 },
+	};
+	const char *source = argc > 1 ? argv[1] : "chacha8";
+	const uint32_t key32[8] = { 0x62656e63, 0x68 };
+	const uint64_t key64[2] = { 0x62656e63, 0x68 };
+	static struct rx_chacha c;
+	static struct rx_philox p;
+#if defined(__x86_64__) && defined(__GNUC__)
+	static struct rx_aes a;
+#endif
+
+	counted.fill = rx_arc4random_fill;
+	if (!strcmp(source, "chacha8") || !strcmp(source, "chacha20")) {
+		rx_chacha_init(&c, key32, 0, source[6] == '8' ? 8 : 20);
+		counted.fill = rx_chacha_fill;
+		counted.arg = &c;
+	} else if (!strcmp(source, "philox")) {
+		rx_philox_init(&p, key64, 0);
+		counted.fill = rx_philox_fill;
+		counted.arg = &p;
+#if defined(__x86_64__) && defined(__GNUC__)
+	} else if (!strcmp(source, "aes") && rx_aes_init(&a, (const uint8_t *)key32, 0) == 0) {
+		counted.fill = rx_aes_fill;
+		counted.arg = &a;
+#endif
+	} else if (strcmp(source, "arc4random")) {
+		fprintf(stderr, "usage: %s [arc4random|chacha8|chacha20|philox|aes]\n", argv[0]);
+		return 1;
+	}
+	rX_source(counted_fill, NULL);
+
+	printf("{\n  \"source\": \"%s\",\n", source);
+#if defined(_LIBCPP_VERSION)
+	printf("  \"stdlib\": \"libc++ %d\",\n", _LIBCPP_VERSION);
+#elif defined(__GLIBCXX__)
+	printf("  \"stdlib\": \"libstdc++ %d\",\n", __GLIBCXX__);
+#endif
+	printf("  \"numbers\": %d,\n  \"results\": [\n", NUMBERS);
+	bench_0to1();
+	for (unsigned i = 0; i < sizeof(ranges) / sizeof(ranges[0]); i++)
+		bench_range(ranges[i][0], ranges[i][1]);
+	bench_ziggurat();
+	printf("\n  ]\n}\n");
+	if (sink == 42)
+		printf("\n");
+	return 0;
+}
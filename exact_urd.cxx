@@ -0,0 +1,160 @@
+/*
+ * Copyright (c) 2015 Artur Grabowski <art@blahonga.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <random>
+#include <sstream>
+#include <vector>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <assert.h>
+
+#include "exact_urd.hxx"
+
+/*
+ * The same experiment as urd.cxx, but with exact_urd.hxx instead of
+ * std::uniform_real_distribution. Every bucket should get about the
+ * same number of hits and nothing should land outside of [from,to).
+ */
+template<class Engine>
+static void
+test_buckets(const char *name, double from, int range)
+{
+	Engine gen;
+	double step = nextafter(from, (from + 1.0) * 2.0) - from;
+	double to = from + step * range;
+	exact_uniform_real_distribution<double> dis(from, to);
+	std::vector<int> bucket(range);
+	int attempts = 100000 * range;
+	int i, minbucket = attempts, maxbucket = 0;
+
+	for (i = 0; i < attempts; i++) {
+		double r = dis(gen);
+		unsigned int b = (int)((r - from)/step);
+		if (r < from || r >= to || b >= (unsigned)range) {
+			printf("%s: %a outside [%a,%a)\n", name, r, from, to);
+			abort();
+		}
+		bucket[b]++;
+	}
+	for (i = 0; i < range; i++) {
+		if (bucket[i] < minbucket)
+			minbucket = bucket[i];
+		if (bucket[i] > maxbucket)
+			maxbucket = bucket[i];
+	}
+	double diff = (double)maxbucket/(double)minbucket - 1.0;
+	if (diff > 0.05) {
+		printf("%s(%a, %d): very large diff (should be close to 0): %f\n",
+		    name, from, range, diff);
+	}
+}
+
+/*
+ * A 64 bit engine should be called once per number.
+ */
+struct counting_engine {
+	typedef uint64_t result_type;
+	static constexpr result_type min() { return std::mt19937_64::min(); }
+	static constexpr result_type max() { return std::mt19937_64::max(); }
+	result_type operator()() { calls++; return gen(); }
+
+	std::mt19937_64 gen;
+	uint64_t calls = 0;
+};
+
+static void
+test_calls(void)
+{
+	counting_engine gen;
+	exact_uniform_real_distribution<double> unit;
+	exact_uniform_real_distribution<double> odd(0x1p52, 0x1p52 + 3);
+	const int n = 1000000;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		double r = unit(gen);
+		/* Everything in [0,1) should be a multiple of 2^-53. */
+		assert(r >= 0.0 && r < 1.0 && ldexp(r, 53) == floor(ldexp(r, 53)));
+	}
+	/* 2^64 is a multiple of 2^53, nothing is ever rejected. */
+	assert(gen.calls == n);
+
+	gen.calls = 0;
+	for (i = 0; i < n; i++)
+		odd(gen);
+	assert(gen.calls == n);
+}
+
+static void
+test_params(void)
+{
+	exact_uniform_real_distribution<double> unit;
+	exact_uniform_real_distribution<double> neg(-3.5, 12.0);
+	exact_uniform_real_distribution<float> f(0.0f, 1.0f);
+	std::mt19937 gen;
+	int i;
+
+	assert(unit.a() == 0.0 && unit.b() == 1.0);
+	assert(unit.min() == 0.0 && unit.max() == nextafter(1.0, 0.0));
+	assert(neg.min() == -3.5 && neg.max() == nextafter(12.0, 0.0));
+	assert(f.min() == 0.0f && f.max() == nextafterf(1.0f, 0.0f));
+
+	for (i = 0; i < 1000000; i++) {
+		double r = neg(gen);
+		float x = f(gen);
+		assert(r >= -3.5 && r < 12.0);
+		assert(x >= 0.0f && x < 1.0f);
+	}
+
+	exact_uniform_real_distribution<double>::param_type p(0.1, 0.7);
+	exact_uniform_real_distribution<double> d(p);
+	assert(d.param() == p && d != unit);
+	d.param(unit.param());
+	assert(d == unit);
+
+	/* from isn't a multiple of the step, so the first number is above it. */
+	exact_uniform_real_distribution<double> odd(0.3, 0.7);
+	assert(odd.min() > 0.3 && odd.min() == nextafter(0.3, 1.0));
+	exact_uniform_real_distribution<double> tiny(0x1p-1074, 0x1p1000);
+	assert(tiny.min() == 0x1p947 && tiny.max() == nextafter(0x1p1000, 0.0));
+	exact_uniform_real_distribution<double> around(-0x1p-60, 1.0);
+	assert(around.min() == 0.0);
+	for (i = 0; i < 1000; i++) {
+		double r = odd(gen), t = tiny(gen);
+		assert(r > 0.3 && r < 0.7 && t >= 0x1p947 && t < 0x1p1000);
+	}
+
+	std::stringstream ss;
+	exact_uniform_real_distribution<double> in;
+	ss << neg;
+	ss >> in;
+	assert(in == neg);
+}
+
+int
+main(int argc, char **argv)
+{
+	test_buckets<std::mt19937_64>("mt19937_64", 1.0, 3);
+	test_buckets<std::mt19937_64>("mt19937_64", 0x1p52, 17);
+	test_buckets<std::mt19937>("mt19937", 1.0, 3);
+	test_buckets<std::minstd_rand>("minstd_rand", 1.0, 42);
+	test_buckets<std::default_random_engine>("default_random_engine", -1.0, 5);
+	test_calls();
+	test_params();
+	return 0;
+}
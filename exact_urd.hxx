@@ -0,0 +1,247 @@
+/*
+ * Copyright (c) 2015 Artur Grabowski <art@blahonga.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef EXACT_URD_HXX
+#define EXACT_URD_HXX
+
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <ios>
+#include <istream>
+#include <limits>
+#include <ostream>
+#include <random>
+#include <string>
+#include <type_traits>
+
+/*
+ * urd.cxx shows that std::uniform_real_distribution is biased and
+ * returns [from,to] instead of [from,to). This is the algorithm from
+ * arbitrary_range.c (rd_positive and rd_any) wrapped up so that it
+ * can be used instead of std::uniform_real_distribution with any
+ * standard random engine:
+ *
+ *	std::mt19937_64 gen;
+ *	exact_uniform_real_distribution<double> dis(from, to);
+ *	double r = dis(gen);
+ *
+ * The numbers generated are the multiples of step in [from, to), where
+ * step is the distance between the doubles at the end of the range
+ * with the biggest absolute value. See arbitrary_range.c for why.
+ *
+ * All the nextafter and counting is done once, in param_type, so
+ * generating a number is a bounded random integer, a multiplication
+ * and an addition. For engines that return 64 random bits (like
+ * std::mt19937_64) the bounded integer is Lemire's multiply-shift
+ * trick from r_uniform and almost always takes just one call to the
+ * engine. Engines returning 32 bits are called twice, anything else
+ * falls back to std::uniform_int_distribution.
+ *
+ * Only works for float and double, the count for anything with a
+ * bigger mantissa doesn't fit in 64 bits.
+ */
+template<class RealType = double>
+class exact_uniform_real_distribution {
+	static_assert(std::is_floating_point<RealType>::value &&
+	    std::numeric_limits<RealType>::digits <= 62,
+	    "exact_uniform_real_distribution needs float or double");
+
+public:
+	typedef RealType result_type;
+
+	class param_type {
+	public:
+		typedef exact_uniform_real_distribution distribution_type;
+
+		explicit param_type(RealType a = 0.0, RealType b = 1.0) : a_(a), b_(b)
+		{
+			assert(a < b);
+			if (a >= 0) {
+				/* rd_positive */
+				step_ = b - std::nextafter(b, a);
+			} else {
+				/* rd_any */
+				step_ = std::nextafter(a, RealType(0)) - a;
+				if (b > 0 && b - std::nextafter(b, RealType(0)) > step_)
+					step_ = b - std::nextafter(b, RealType(0));
+			}
+			/* The multiples of step in [a, b), see numbers_between. */
+			first_ = ceil_div(a, step_);
+			count_ = ceil_div(b, step_) - first_;
+			/* count is at least 1 and for 1 this is 0, which never rejects. */
+			min_ = -count_ % count_;
+		}
+
+		RealType a() const { return a_; }
+		RealType b() const { return b_; }
+
+		friend bool operator==(const param_type &x, const param_type &y)
+		{
+			return x.a_ == y.a_ && x.b_ == y.b_;
+		}
+		friend bool operator!=(const param_type &x, const param_type &y)
+		{
+			return !(x == y);
+		}
+
+	private:
+		friend class exact_uniform_real_distribution;
+
+		RealType a_, b_;
+		RealType step_;
+		uint64_t count_;
+		uint64_t min_;		/* 2**64 % count, see r_uniform. */
+		int64_t first_;		/* a / step rounded up. */
+
+		/*
+		 * step is a power of two, so the division is exact unless
+		 * the result is too small to be a normal number. Then x is
+		 * less than one step and the answer is 0 or 1, but the
+		 * division might have rounded it to 0.
+		 */
+		static int64_t ceil_div(RealType x, RealType step)
+		{
+			RealType q = x / step;
+
+			return (int64_t)std::ceil(q) + (x > 0 && q == 0);
+		}
+	};
+
+	explicit exact_uniform_real_distribution(RealType a = 0.0, RealType b = 1.0) : p_(a, b) {}
+	explicit exact_uniform_real_distribution(const param_type &p) : p_(p) {}
+
+	void reset() {}
+
+	param_type param() const { return p_; }
+	void param(const param_type &p) { p_ = p; }
+
+	RealType a() const { return p_.a(); }
+	RealType b() const { return p_.b(); }
+
+	result_type min() const { return value(p_, 0); }
+	result_type max() const { return value(p_, p_.count_ - 1); }
+
+	template<class URBG>
+	result_type operator()(URBG &g) { return (*this)(g, p_); }
+
+	template<class URBG>
+	result_type operator()(URBG &g, const param_type &p)
+	{
+		return value(p, bounded(g, p, engine_kind<URBG>()));
+	}
+
+	friend bool operator==(const exact_uniform_real_distribution &x,
+	    const exact_uniform_real_distribution &y)
+	{
+		return x.p_ == y.p_;
+	}
+	friend bool operator!=(const exact_uniform_real_distribution &x,
+	    const exact_uniform_real_distribution &y)
+	{
+		return !(x == y);
+	}
+
+	/* Hex floats so that reading it back gives us exactly the same range. */
+	template<class CharT, class Traits>
+	friend std::basic_ostream<CharT, Traits> &
+	operator<<(std::basic_ostream<CharT, Traits> &os, const exact_uniform_real_distribution &d)
+	{
+		std::ios_base::fmtflags flags = os.flags();
+
+		os.flags(std::ios_base::dec | std::ios_base::left);
+		os << std::hexfloat << d.a() << os.widen(' ') << d.b();
+		os.flags(flags);
+		return os;
+	}
+
+	template<class CharT, class Traits>
+	friend std::basic_istream<CharT, Traits> &
+	operator>>(std::basic_istream<CharT, Traits> &is, exact_uniform_real_distribution &d)
+	{
+		std::ios_base::fmtflags flags = is.flags();
+		double a, b;
+
+		/*
+		 * libstdc++ can't parse hex floats with operator>>, so
+		 * read the words and let strtod do it.
+		 */
+		std::basic_string<CharT, Traits> sa, sb;
+		is.flags(std::ios_base::dec | std::ios_base::skipws);
+		if (is >> sa >> sb) {
+			a = std::strtod(std::string(sa.begin(), sa.end()).c_str(), nullptr);
+			b = std::strtod(std::string(sb.begin(), sb.end()).c_str(), nullptr);
+			if (a < b)
+				d.param(param_type(a, b));
+			else
+				is.setstate(std::ios_base::failbit);
+		}
+		is.flags(flags);
+		return is;
+	}
+
+private:
+	param_type p_;
+
+	/* 0: full 64 bit engine, 1: full 32 bit engine, 2: anything else. */
+	template<class URBG>
+	using engine_kind = std::integral_constant<int,
+	    (URBG::min() == 0 && URBG::max() == UINT64_MAX) ? 0 :
+	    (URBG::min() == 0 && URBG::max() == UINT32_MAX) ? 1 : 2>;
+
+	/* first + k is at most 2^53 (2^24 for float), so nothing rounds. */
+	static RealType value(const param_type &p, uint64_t k)
+	{
+		return (RealType)(p.first_ + (int64_t)k) * p.step_;
+	}
+
+	static uint64_t lemire(uint64_t r, const param_type &p, unsigned __int128 &m)
+	{
+		m = (unsigned __int128)r * p.count_;
+		return (uint64_t)m;
+	}
+
+	template<class URBG>
+	static uint64_t bounded(URBG &g, const param_type &p, std::integral_constant<int, 0>)
+	{
+		unsigned __int128 m;
+
+		while (lemire(g(), p, m) < p.min_)
+			;
+		return m >> 64;
+	}
+
+	template<class URBG>
+	static uint64_t bounded(URBG &g, const param_type &p, std::integral_constant<int, 1>)
+	{
+		unsigned __int128 m;
+
+		for (;;) {
+			uint64_t r = (uint64_t)g() << 32;
+			if (lemire(r | g(), p, m) >= p.min_)
+				return m >> 64;
+		}
+	}
+
+	template<class URBG>
+	static uint64_t bounded(URBG &g, const param_type &p, std::integral_constant<int, 2>)
+	{
+		return std::uniform_int_distribution<uint64_t>(0, p.count_ - 1)(g);
+	}
+};
+
+#endif /* EXACT_URD_HXX */
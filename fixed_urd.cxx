@@ -0,0 +1,101 @@
+/*
+ * Copyright (c) 2015 Artur Grabowski <art@blahonga.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <random>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <assert.h>
+
+#include "exact_urd.hxx"
+#include "fixed_urd.hxx"
+
+/*
+ * Tests for fixed_urd.hxx. Compile with -std=c++20.
+ *
+ * The counts are the ones from test_ranges() in arbitrary_range.c,
+ * checked by the compiler. An impossible range doesn't compile:
+ *
+ *	fixed_uniform_real_distribution<1.0, 0.5> broken;
+ */
+static_assert(fixed_uniform_real_distribution<0x1p52, 0x1p52 + 3>::count == 3);
+static_assert(fixed_uniform_real_distribution<0x1p55, 0x1p55 + 25>::count == 3);
+static_assert(fixed_uniform_real_distribution<0.0, 0x1p53 + 2>::count == (1ULL << 52) + 1);
+static_assert(fixed_uniform_real_distribution<0.3, 0.7>::count == 3602879701896396);
+static_assert(fixed_uniform_real_distribution<0x1p-1074, 0x1p1000>::count == (1ULL << 53) - 1);
+static_assert(fixed_uniform_real_distribution<0x1p-1074, 0x1p1000>::min() == 0x1p947);
+
+/* The ones that should reduce to a shift and/or an add. */
+static_assert(fixed_uniform_real_distribution<0.0, 1.0>::power_of_two &&
+    !fixed_uniform_real_distribution<0.0, 1.0>::consecutive);
+static_assert(fixed_uniform_real_distribution<1.0, 2.0>::power_of_two &&
+    fixed_uniform_real_distribution<1.0, 2.0>::consecutive);
+static_assert(fixed_uniform_real_distribution<0x1p-60, 0x1p-59>::power_of_two &&
+    fixed_uniform_real_distribution<0x1p-60, 0x1p-59>::consecutive);
+static_assert(fixed_uniform_real_distribution<0.0, 0x1p-1022>::consecutive);
+static_assert(!fixed_uniform_real_distribution<0x1p52, 0x1p52 + 3>::power_of_two &&
+    fixed_uniform_real_distribution<0x1p52, 0x1p52 + 3>::consecutive);
+static_assert(fixed_uniform_real_distribution<0.1, 0.7>::threshold ==
+    -fixed_uniform_real_distribution<0.1, 0.7>::count %
+    fixed_uniform_real_distribution<0.1, 0.7>::count);
+
+/*
+ * Exactly the same numbers as exact_uniform_real_distribution from
+ * the same engine, no matter which of the shortcuts is taken.
+ */
+template<double From, double To, class Engine>
+static void
+test_same(const char *name)
+{
+	Engine g1, g2;
+	fixed_uniform_real_distribution<From, To> f;
+	exact_uniform_real_distribution<double> e(From, To);
+	int i;
+
+	assert(f.min() == e.min() && f.max() == e.max());
+	for (i = 0; i < 1000000; i++) {
+		double a = f(g1), b = e(g2);
+		if (a != b || a < From || a >= To) {
+			printf("fixed<%a, %a>(%s)[%d]: %a, exact: %a\n", From, To, name, i, a, b);
+			abort();
+		}
+	}
+}
+
+template<class Engine>
+static void
+test_engine(const char *name)
+{
+	test_same<0.0, 1.0, Engine>(name);
+	test_same<1.0, 2.0, Engine>(name);
+	test_same<0x1p-60, 0x1p-59, Engine>(name);
+	test_same<0.0, 0x1p-1022, Engine>(name);
+	test_same<0x1p52, 0x1p52 + 3, Engine>(name);
+	test_same<0x1p55, 0x1p55 + 25, Engine>(name);
+	test_same<0.3, 0.7, Engine>(name);
+	test_same<0.1, 0x1p52 + 1000, Engine>(name);
+	test_same<0x1p-1074, 0x1p1000, Engine>(name);
+}
+
+int
+main(int argc, char **argv)
+{
+	test_engine<std::mt19937_64>("mt19937_64");
+	test_engine<std::mt19937>("mt19937");
+	test_engine<std::minstd_rand>("minstd_rand");
+	return 0;
+}
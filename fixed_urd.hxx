@@ -0,0 +1,186 @@
+/*
+ * Copyright (c) 2015 Artur Grabowski <art@blahonga.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef FIXED_URD_HXX
+#define FIXED_URD_HXX
+
+#if __cplusplus < 202002L
+#error "fixed_urd.hxx needs C++20, doubles as template parameters"
+#endif
+
+#include <bit>
+#include <cstdint>
+#include <limits>
+#include <random>
+#include <type_traits>
+
+namespace fixed_urd_detail {
+
+constexpr uint64_t bits(double d) { return std::bit_cast<uint64_t>(d); }
+
+struct range {
+	uint64_t count;
+	double step, start;
+};
+
+/* rd_range_count from rd_range.h, see numbers_between in arbitrary_range.c. */
+constexpr range
+count_range(double from, double to)
+{
+	const uint64_t M = (1ULL << 52) - 1;
+	uint64_t f = bits(from) & ~(1ULL << 63), t = bits(to), n = t - 1;
+	uint64_t ef = (f >> 52) + ((f >> 52) == 0);
+	uint64_t et = (t >> 52) + ((t >> 52) == 0);
+	uint64_t s = (n >> 52) + ((n >> 52) == 0);
+	uint64_t mf = (f & M) | (uint64_t)((f >> 52) != 0) << 52;
+	uint64_t mt = (t & M) | (uint64_t)((t >> 52) != 0) << 52;
+	uint64_t sh = s - ef < 63 ? s - ef : 63;
+	uint64_t first = (mf >> sh) + ((mf & ((1ULL << sh) - 1)) != 0);
+	double step = std::bit_cast<double>(s > 52 ? (s - 52) << 52 : 1ULL << (s - 1));
+
+	return { (mt << (et - s)) - first, step, (double)first * step };
+}
+
+}
+
+/*
+ * Most ranges are known when the program is compiled: [0,1), [1,2)
+ * from r1to2, the binades from r2range. For those even the work in
+ * the param_type of exact_urd.hxx is wasted, so here the range is a
+ * template parameter and the counting from rd_range_count in
+ * rd_range.h is done by the compiler:
+ *
+ *	std::mt19937_64 gen;
+ *	fixed_uniform_real_distribution<0.0, 1.0> dis;
+ *	double r = dis(gen);
+ *
+ * It generates exactly the same numbers as
+ * exact_uniform_real_distribution<double>(From, To) from the same
+ * engine. Positive ranges only, like rd_range.h, and a range that
+ * isn't one is a compile error instead of an assert.
+ *
+ * Since everything is a constant the compiler can pick the cheapest
+ * way to get there:
+ *
+ *  - when the count is a power of two (the binades, [0,1), [0,2^53))
+ *    nothing is ever rejected and Lemire's multiplication is just
+ *    the top bits of the random number, so it's a shift,
+ *  - when all the numbers are in one binade (or all are subnormal)
+ *    the bits of the doubles are consecutive integers and the number
+ *    is the bits of the first one plus the random number, so it's an
+ *    integer add and no floating point at all,
+ *  - otherwise it's Lemire with the threshold known at compile time.
+ */
+template<double From, double To>
+class fixed_uniform_real_distribution {
+	static_assert(From >= 0 && From < To && To < std::numeric_limits<double>::infinity(),
+	    "fixed_uniform_real_distribution needs a positive range");
+
+	static constexpr uint64_t bits(double d) { return fixed_urd_detail::bits(d); }
+	static constexpr fixed_urd_detail::range r_ = fixed_urd_detail::count_range(From, To);
+
+public:
+	typedef double result_type;
+
+	static constexpr uint64_t count = r_.count;
+	static constexpr double step = r_.step;
+	static constexpr double start = r_.start;	/* From rounded up to a multiple of step. */
+	static constexpr uint64_t threshold = -count % count;	/* 2**64 % count */
+	static constexpr bool power_of_two = std::has_single_bit(count);
+	static constexpr bool consecutive =
+	    bits(start) + (count - 1) == bits(start + (double)(count - 1) * step);
+
+	static constexpr double a() { return From; }
+	static constexpr double b() { return To; }
+	static constexpr result_type min() { return value(0); }
+	static constexpr result_type max() { return value(count - 1); }
+
+	void reset() {}
+
+	template<class URBG>
+	result_type operator()(URBG &g) const
+	{
+		return value(bounded(g, engine_kind<URBG>()));
+	}
+
+	friend constexpr bool operator==(const fixed_uniform_real_distribution &,
+	    const fixed_uniform_real_distribution &) { return true; }
+
+private:
+	/* 0: full 64 bit engine, 1: full 32 bit engine, 2: anything else. */
+	template<class URBG>
+	using engine_kind = std::integral_constant<int,
+	    (URBG::min() == 0 && URBG::max() == UINT64_MAX) ? 0 :
+	    (URBG::min() == 0 && URBG::max() == UINT32_MAX) ? 1 : 2>;
+
+	static constexpr result_type value(uint64_t k)
+	{
+		if constexpr (consecutive)
+			return std::bit_cast<double>(bits(start) + k);
+		else
+			return start + (double)k * step;
+	}
+
+	/* Lemire, see r_uniform in arbitrary_range.c. */
+	static uint64_t reduce(uint64_t r, bool &reject)
+	{
+		if constexpr (count == 1) {
+			reject = false;
+			return 0;
+		} else if constexpr (power_of_two) {
+			reject = false;
+			return r >> (64 - std::countr_zero(count));
+		} else {
+			unsigned __int128 m = (unsigned __int128)r * count;
+
+			reject = (uint64_t)m < threshold;
+			return m >> 64;
+		}
+	}
+
+	template<class URBG>
+	static uint64_t bounded(URBG &g, std::integral_constant<int, 0>)
+	{
+		bool reject;
+		uint64_t k;
+
+		do {
+			k = reduce(g(), reject);
+		} while (reject);
+		return k;
+	}
+
+	template<class URBG>
+	static uint64_t bounded(URBG &g, std::integral_constant<int, 1>)
+	{
+		bool reject;
+		uint64_t k;
+
+		do {
+			uint64_t r = (uint64_t)g() << 32;
+			k = reduce(r | g(), reject);
+		} while (reject);
+		return k;
+	}
+
+	template<class URBG>
+	static uint64_t bounded(URBG &g, std::integral_constant<int, 2>)
+	{
+		return std::uniform_int_distribution<uint64_t>(0, count - 1)(g);
+	}
+};
+
+#endif /* FIXED_URD_HXX */
@@ -0,0 +1,254 @@
+/*
+ * Copyright (c) 2015 Artur Grabowski <art@blahonga.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef GOF_H
+#define GOF_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <math.h>
+#include <assert.h>
+
+/*
+ * Goodness of fit for the bucket tests.
+ *
+ * The tests in arbitrary_range.c used to put the numbers in an `int`
+ * array and complain when the biggest bucket was more than 5% bigger
+ * than the smallest. That catches a generator that is completely
+ * broken, like rd_naive, but a bias of 1% goes right through it no
+ * matter how many numbers we generate, and the counts overflow after
+ * 2^31 numbers.
+ *
+ * So instead the numbers are counted in 64 bit buckets and we ask
+ * how likely the counts are if the generator is uniform: Pearson's
+ * chi-square over the buckets and Kolmogorov-Smirnov over the
+ * cumulative counts, both with p-values. The more numbers we look at
+ * the smaller a bias has to be to get a tiny p-value.
+ *
+ * A histogram only counts, so every thread can have its own and they
+ * are added together with gof_hist_merge at the end.
+ */
+
+#define GOF_BATCH 512
+
+struct gof_hist {
+	double from, scale;
+	uint64_t nbuckets;
+	uint64_t n;
+	uint64_t *count;
+};
+
+/*
+ * nbuckets buckets of equal width in [from, to). The expected count
+ * is the same in every bucket only when the number of numbers the
+ * generator can return is a multiple of nbuckets, so pick ranges and
+ * bucket counts where it is.
+ */
+static inline void
+gof_hist_init(struct gof_hist *h, double from, double to, uint64_t nbuckets)
+{
+	assert(from < to && nbuckets > 0 && nbuckets <= UINT32_MAX);
+	h->from = from;
+	h->scale = nbuckets / (to - from);
+	h->nbuckets = nbuckets;
+	h->n = 0;
+	if ((h->count = calloc(nbuckets, sizeof(*h->count))) == NULL)
+		abort();
+}
+
+static inline void
+gof_hist_free(struct gof_hist *h)
+{
+	free(h->count);
+	h->count = NULL;
+}
+
+/*
+ * The bucket numbers are computed for GOF_BATCH numbers at a time in
+ * a loop without dependencies or branches, which the compiler turns
+ * into vector code, and then the buckets are incremented. Numbers
+ * outside [from, to) end up in the first or last bucket, so check the
+ * range separately, it can't be told from here. Rounding can push a
+ * number just below `to` over the last bucket, that's why there's a
+ * clamp at the top too.
+ */
+static inline void
+gof_hist_add(struct gof_hist *h, const double *v, size_t n)
+{
+	const double top = h->nbuckets - 1;
+	uint32_t idx[GOF_BATCH];
+	size_t i, j, len;
+
+	for (i = 0; i < n; i += len) {
+		len = n - i < GOF_BATCH ? n - i : GOF_BATCH;
+		for (j = 0; j < len; j++) {
+			double x = (v[i + j] - h->from) * h->scale;
+
+			x = x > 0 ? x : 0;
+			x = x < top ? x : top;
+			idx[j] = (uint32_t)x;
+		}
+		for (j = 0; j < len; j++)
+			h->count[idx[j]]++;
+	}
+	h->n += n;
+}
+
+static inline void
+gof_hist_add1(struct gof_hist *h, double v)
+{
+	gof_hist_add(h, &v, 1);
+}
+
+static inline void
+gof_hist_merge(struct gof_hist *to, const struct gof_hist *from)
+{
+	uint64_t i;
+
+	assert(to->nbuckets == from->nbuckets);
+	for (i = 0; i < to->nbuckets; i++)
+		to->count[i] += from->count[i];
+	to->n += from->n;
+}
+
+/*
+ * The regularized upper incomplete gamma function Q(a, x), which is
+ * the probability that chi-square with 2a degrees of freedom is more
+ * than 2x. Series below a + 1 and continued fraction above, like in
+ * every numerical recipes book ever written.
+ */
+static inline double
+gof_gamma_q(double a, double x)
+{
+	double lpre;
+	int i;
+
+	if (x <= 0)
+		return 1.0;
+	lpre = a * log(x) - x - lgamma(a);
+	if (x < a + 1) {
+		double sum = 1.0 / a, term = sum, ap = a;
+
+		for (i = 0; i < 1000000 && fabs(term) > fabs(sum) * 1e-16; i++) {
+			ap += 1;
+			term *= x / ap;
+			sum += term;
+		}
+		return 1.0 - sum * exp(lpre);
+	} else {
+		double b = x + 1 - a, c = 1 / 1e-300, d = 1 / b, f = d, del;
+
+		for (i = 1; i < 1000000; i++) {
+			double an = -i * (i - a);
+
+			b += 2;
+			d = an * d + b;
+			if (fabs(d) < 1e-300)
+				d = 1e-300;
+			c = b + an / c;
+			if (fabs(c) < 1e-300)
+				c = 1e-300;
+			d = 1 / d;
+			del = d * c;
+			f *= del;
+			if (fabs(del - 1) < 1e-16)
+				break;
+		}
+		return exp(lpre) * f;
+	}
+}
+
+/*
+ * The probability that chi-square with df degrees of freedom is at
+ * least stat.
+ */
+static inline double
+gof_chisq_p(double stat, double df)
+{
+	return gof_gamma_q(df / 2, stat / 2);
+}
+
+static inline double
+gof_chisq(const struct gof_hist *h, double *statp)
+{
+	double expected = (double)h->n / h->nbuckets, stat = 0;
+	uint64_t i;
+
+	for (i = 0; i < h->nbuckets; i++) {
+		double d = h->count[i] - expected;
+
+		stat += d * d / expected;
+	}
+	*statp = stat;
+	return gof_chisq_p(stat, h->nbuckets - 1);
+}
+
+/*
+ * Kolmogorov-Smirnov against the uniform distribution, but on the
+ * buckets and not on the numbers, since we don't keep the numbers.
+ * The biggest difference between the counted and the expected
+ * cumulative distribution can only be seen at the bucket edges, so D
+ * is never bigger than for the numbers themselves and the p-value is
+ * on the safe side. Stephens' approximation for the distribution of
+ * D.
+ */
+static inline double
+gof_ks(const struct gof_hist *h, double *dp)
+{
+	double d = 0, sum = 0, en, lambda, p = 0;
+	uint64_t i;
+	int j;
+
+	for (i = 0; i < h->nbuckets; i++) {
+		double diff;
+
+		sum += h->count[i];
+		diff = fabs(sum / h->n - (double)(i + 1) / h->nbuckets);
+		if (diff > d)
+			d = diff;
+	}
+	*dp = d;
+	en = sqrt((double)h->n);
+	lambda = (en + 0.12 + 0.11 / en) * d;
+	if (lambda < 0.2)
+		return 1.0;
+	for (j = 1; j < 100; j++) {
+		double term = 2 * ((j & 1) ? 1 : -1) * exp(-2 * j * j * lambda * lambda);
+
+		p += term;
+		if (fabs(term) < 1e-17)
+			break;
+	}
+	return p < 0 ? 0 : p > 1 ? 1 : p;
+}
+
+/*
+ * Something that should happen with probability p happened k times
+ * out of n. Two sided p-value of that with the normal approximation
+ * of the binomial distribution, which is fine for the counts we look
+ * at, and the deviation in standard deviations in *zp.
+ */
+static inline double
+gof_binomial_p(uint64_t k, uint64_t n, double p, double *zp)
+{
+	double mean = n * p, sd = sqrt(n * p * (1 - p));
+
+	*zp = sd > 0 ? (k - mean) / sd : 0;
+	return erfc(fabs(*zp) / sqrt(2.0));
+}
+
+#endif /* GOF_H */
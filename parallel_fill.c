@@ -0,0 +1,124 @@
+/*
+ * Copyright (c) 2015 Artur Grabowski <art@blahonga.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <assert.h>
+#include <time.h>
+
+#include "rX.h"
+#include "r0to1.h"
+#include "rd_range.h"
+#include "parallel_fill.h"
+
+/*
+ * Check that parallel_fill gives the same result no matter how many
+ * threads we throw at it, and see how fast it is.
+ */
+
+static void
+fill_r0to1b(void *arg, double *out, size_t n)
+{
+	(void)arg;
+	r0to1b_fill(out, n);
+}
+
+static void
+fill_range(void *arg, double *out, size_t n)
+{
+	rd_range_fill(arg, out, n);
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void
+test_threads(const char *name, pfill_fn fn, void *arg, double from, double to)
+{
+	/* Not a multiple of PFILL_BLOCK, so the last block is short. */
+	const size_t n = 50 * PFILL_BLOCK + 12345;
+	const int threads[] = { 2, 3, 8, 0 };
+	double *a = malloc(n * sizeof(*a)), *b = malloc(n * sizeof(*b));
+	size_t i;
+	unsigned t;
+
+	assert(a != NULL && b != NULL);
+
+	parallel_fill(a, n, fn, arg, 4711, 1);
+	for (i = 0; i < n; i++)
+		assert(a[i] >= from && a[i] < to);
+	/* Different blocks must not be the same stream. */
+	assert(memcmp(a, a + PFILL_BLOCK, PFILL_BLOCK * sizeof(*a)));
+
+	for (t = 0; t < sizeof(threads) / sizeof(threads[0]); t++) {
+		memset(b, 0, n * sizeof(*b));
+		parallel_fill(b, n, fn, arg, 4711, threads[t]);
+		if (memcmp(a, b, n * sizeof(*a))) {
+			printf("%s: %d threads differ from 1 thread\n", name, threads[t]);
+			abort();
+		}
+	}
+
+	parallel_fill(b, n, fn, arg, 4712, 2);
+	assert(memcmp(a, b, n * sizeof(*a)));
+
+	free(a);
+	free(b);
+}
+
+static void
+speed(const char *name, pfill_fn fn, void *arg, int nthreads)
+{
+	const size_t n = 1 << 27;
+	double *a = malloc(n * sizeof(*a));
+	double t;
+
+	assert(a != NULL);
+	/* Touch the memory first so we don't measure page faults. */
+	memset(a, 0, n * sizeof(*a));
+	t = now();
+	parallel_fill(a, n, fn, arg, 1, nthreads);
+	t = now() - t;
+	printf("%-12s %2d threads: %6.2f ns/double, %7.1f MB/s\n", name, nthreads,
+	    t * 1e9 / n, n * sizeof(*a) / t / 1e6);
+	free(a);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct rd_range rr;
+	int ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+
+	test_threads("r0to1b", fill_r0to1b, NULL, 0.0, 1.0);
+	rd_range_init(&rr, 0x1p52, 0x1p52 + 17);
+	test_threads("rd_range", fill_range, &rr, 0x1p52, 0x1p52 + 17);
+
+	speed("r0to1b", fill_r0to1b, NULL, 1);
+	speed("r0to1b", fill_r0to1b, NULL, ncpu);
+	rd_range_init(&rr, 0.1, 0.7);
+	speed("rd_range", fill_range, &rr, 1);
+	speed("rd_range", fill_range, &rr, ncpu);
+	return 0;
+}
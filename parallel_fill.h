@@ -0,0 +1,174 @@
+/*
+ * Copyright (c) 2015 Artur Grabowski <art@blahonga.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef PARALLEL_FILL_H
+#define PARALLEL_FILL_H
+
+#include <stddef.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "rX.h"
+#include "rX_sources.h"
+
+/*
+ * Filling an array with 10^9 numbers on one thread takes too long, but
+ * just splitting the array between threads each with their own random
+ * bits would make the result depend on how many threads we had and
+ * which thread happened to get which part of the array. When we want
+ * to reproduce a run from a seed, that's not acceptable.
+ *
+ * So the array is split into blocks of PFILL_BLOCK numbers and every
+ * block gets its own stream of random bits: ChaCha8 keyed with the
+ * seed and with the block number as the nonce. Since ChaCha is a
+ * counter mode generator, starting a stream anywhere costs nothing.
+ * No matter which thread generates a block, or when, it's always
+ * generated from the same bits, so 1, 8 or 96 threads give byte
+ * identical results.
+ *
+ * Which thread does which block is work stealing: every thread starts
+ * out owning a contiguous part of the array (so on NUMA machines the
+ * memory it first touches is its own), takes blocks from the front of
+ * its part, and when it runs out it steals the back half of what some
+ * other thread has left. A slow core or a busy node just ends up doing
+ * fewer blocks.
+ *
+ * `fn` generates n numbers into out using rX(), for example
+ * r0to1b_fill or rd_range_fill with the range in `arg`.
+ */
+
+#define PFILL_BLOCK (1 << 16)
+
+typedef void (*pfill_fn)(void *arg, double *out, size_t n);
+
+struct pfill_worker {
+	pthread_mutex_t mtx;
+	size_t next, end;		/* Blocks [next, end) not taken yet. */
+	struct pfill *pf;
+	pthread_t thr;
+} __attribute__((aligned(64)));
+
+struct pfill {
+	double *out;
+	size_t n;
+	pfill_fn fn;
+	void *arg;
+	uint32_t key[8];
+	int nthreads;
+	struct pfill_worker *w;
+};
+
+static inline int
+pfill_take(struct pfill_worker *w, size_t *blk)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&w->mtx);
+	if (w->next < w->end) {
+		*blk = w->next++;
+		ret = 1;
+	}
+	pthread_mutex_unlock(&w->mtx);
+	return ret;
+}
+
+static inline int
+pfill_steal(struct pfill_worker *self, size_t *blk)
+{
+	struct pfill *pf = self->pf;
+	int me = self - pf->w;
+	int i;
+
+	for (i = 1; i < pf->nthreads; i++) {
+		struct pfill_worker *v = &pf->w[(me + i) % pf->nthreads];
+		size_t from, to;
+
+		pthread_mutex_lock(&v->mtx);
+		from = v->end - (v->end - v->next) / 2;
+		if (from == v->end && v->next < v->end)
+			from = v->next;		/* Only one left. */
+		to = v->end;
+		v->end = from;
+		pthread_mutex_unlock(&v->mtx);
+
+		if (from == to)
+			continue;
+		pthread_mutex_lock(&self->mtx);
+		self->next = from + 1;
+		self->end = to;
+		pthread_mutex_unlock(&self->mtx);
+		*blk = from;
+		return 1;
+	}
+	return 0;
+}
+
+static inline void *
+pfill_thread(void *arg)
+{
+	struct pfill_worker *w = arg;
+	struct pfill *pf = w->pf;
+	struct rx_chacha c;
+	size_t blk;
+
+	while (pfill_take(w, &blk) || pfill_steal(w, &blk)) {
+		size_t off = blk * PFILL_BLOCK;
+		size_t len = pf->n - off < PFILL_BLOCK ? pf->n - off : PFILL_BLOCK;
+
+		rx_chacha_init(&c, pf->key, blk, 8);
+		rX_source(rx_chacha_fill, &c);
+		pf->fn(pf->arg, pf->out + off, len);
+	}
+	return NULL;
+}
+
+/*
+ * nthreads == 0 means one thread per online cpu.
+ */
+static inline void
+parallel_fill(double *out, size_t n, pfill_fn fn, void *arg, uint64_t seed, int nthreads)
+{
+	size_t nblocks = (n + PFILL_BLOCK - 1) / PFILL_BLOCK;
+	struct pfill pf = { out, n, fn, arg, { seed, seed >> 32, 0, 0, 0, 0, 0, 0 }, 0, NULL };
+	int i;
+
+	if (nthreads <= 0)
+		nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nthreads < 1)
+		nthreads = 1;
+	pf.nthreads = nthreads;
+	if ((pf.w = aligned_alloc(64, nthreads * sizeof(*pf.w))) == NULL)
+		abort();
+
+	for (i = 0; i < nthreads; i++) {
+		pthread_mutex_init(&pf.w[i].mtx, NULL);
+		pf.w[i].next = nblocks * i / nthreads;
+		pf.w[i].end = nblocks * (i + 1) / nthreads;
+		pf.w[i].pf = &pf;
+	}
+	for (i = 0; i < nthreads; i++)
+		if (pthread_create(&pf.w[i].thr, NULL, pfill_thread, &pf.w[i]))
+			abort();
+	for (i = 0; i < nthreads; i++)
+		pthread_join(pf.w[i].thr, NULL);
+	/* Not before they're all done, the others might still try to steal. */
+	for (i = 0; i < nthreads; i++)
+		pthread_mutex_destroy(&pf.w[i].mtx);
+	free(pf.w);
+}
+
+#endif /* PARALLEL_FILL_H */
@@ -0,0 +1,391 @@
+/*
+ * Copyright (c) 2015 Artur Grabowski <art@blahonga.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef R0TO1_H
+#define R0TO1_H
+
+#include <stddef.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "rX.h"
+
+/*
+ * Bulk version of r0to1b() from rd.c: fill an array of doubles in
+ * [0,1).
+ *
+ * r0to1b() does ffsll, a branch and an ldexp for every number. None
+ * of that is necessary. Let r be the 53 random bits and low = r & -r
+ * its lowest set bit. If low is bit number e - 1 (e is what ffsll
+ * returns), then:
+ *
+ *  - the exponent of the result is -e, which is 1023 - e biased,
+ *  - the mantissa is (r >> e) << (e - 1), which is the same thing
+ *    as (r ^ low) >> 1 since all the bits below low are 0,
+ *  - r == 0 and e == 53 give us 0.0.
+ *
+ * So the bits of the double can be put together directly and the
+ * only hard part is finding e without a loop. Without AVX-512 there
+ * is no vector instruction counting zeroes, but converting low to a
+ * double puts e in the exponent for free.
+ *
+ * Every number consumes 53 bits straight out of the rX() buffer, in
+ * the same order rX(53) would hand them out, so r0to1b_fill() gives
+ * the exact same numbers as calling r0to1b() the same number of
+ * times. rd.c checks that.
+ */
+
+static inline double
+r0to1b_bits(uint64_t r)
+{
+	union {
+		uint64_t u;
+		double d;
+	} res;
+	uint64_t low = r & -r;
+	int e;
+
+	if (low == 0 || low == (1ULL << 52))
+		return 0.0;
+	e = __builtin_ctzll(low) + 1;
+	res.u = ((uint64_t)(1023 - e) << 52) | ((r ^ low) >> 1);
+	return res.d;
+}
+
+/*
+ * The kernels convert n numbers whose bits start at bit `pos` of
+ * `buf`. The caller guarantees that all n * 53 bits are in the buffer.
+ */
+typedef void (*r0to1b_kernel)(double *, size_t, const uint64_t *, uint64_t);
+
+static inline void
+r0to1b_kernel_scalar(double *out, size_t n, const uint64_t *buf, uint64_t pos)
+{
+	const unsigned char *b = (const unsigned char *)buf;
+	size_t i;
+
+	for (i = 0; i < n; i++, pos += 53) {
+		uint64_t r;
+
+		memcpy(&r, b + (pos >> 3), sizeof(r));
+		out[i] = r0to1b_bits((r >> (pos & 7)) & ((1ULL << 53) - 1));
+	}
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+
+__attribute__((target("avx2")))
+static inline void
+r0to1b_kernel_avx2(double *out, size_t n, const uint64_t *buf, uint64_t pos)
+{
+	const __m256i mask = _mm256_set1_epi64x((1LL << 53) - 1);
+	const __m256i magic = _mm256_set1_epi64x(0x4330000000000000LL);	/* 2^52 */
+	const __m256i top = _mm256_set1_epi64x(1LL << 52);
+	const __m256i ebias = _mm256_set1_epi64x(2045LL << 52);
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i seven = _mm256_set1_epi64x(7);
+	const __m256i stride = _mm256_set1_epi64x(4 * 53);
+	__m256i bit = _mm256_add_epi64(_mm256_set1_epi64x(pos),
+	    _mm256_setr_epi64x(0, 53, 106, 159));
+	size_t i;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		__m256i r, low, m, lowd, res, ok;
+
+		r = _mm256_i64gather_epi64((const long long *)buf,
+		    _mm256_srli_epi64(bit, 3), 1);
+		r = _mm256_and_si256(_mm256_srlv_epi64(r,
+		    _mm256_and_si256(bit, seven)), mask);
+		low = _mm256_and_si256(r, _mm256_sub_epi64(zero, r));
+		m = _mm256_srli_epi64(_mm256_xor_si256(r, low), 1);
+		/*
+		 * low is at most 2^52, so or:ing it into the mantissa
+		 * of 2^52 and subtracting 2^52 converts it to a double
+		 * exactly. Its biased exponent is 1022 + e.
+		 */
+		lowd = _mm256_castpd_si256(_mm256_sub_pd(
+		    _mm256_castsi256_pd(_mm256_or_si256(low, magic)),
+		    _mm256_castsi256_pd(magic)));
+		res = _mm256_or_si256(_mm256_sub_epi64(ebias, lowd), m);
+		ok = _mm256_and_si256(_mm256_cmpgt_epi64(low, zero),
+		    _mm256_cmpgt_epi64(top, low));
+		_mm256_storeu_si256((__m256i *)(out + i),
+		    _mm256_and_si256(res, ok));
+		bit = _mm256_add_epi64(bit, stride);
+	}
+	r0to1b_kernel_scalar(out + i, n - i, buf, pos + i * 53);
+}
+
+__attribute__((target("avx512f,avx512cd")))
+static inline void
+r0to1b_kernel_avx512(double *out, size_t n, const uint64_t *buf, uint64_t pos)
+{
+	const __m512i mask = _mm512_set1_epi64((1LL << 53) - 1);
+	const __m512i one = _mm512_set1_epi64(1);
+	const __m512i lastok = _mm512_set1_epi64((1LL << 52) - 1);
+	const __m512i ebias = _mm512_set1_epi64(959);
+	const __m512i seven = _mm512_set1_epi64(7);
+	const __m512i stride = _mm512_set1_epi64(8 * 53);
+	__m512i bit = _mm512_add_epi64(_mm512_set1_epi64(pos),
+	    _mm512_setr_epi64(0, 53, 106, 159, 212, 265, 318, 371));
+	size_t i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		__m512i r, low, m, e;
+		__mmask8 ok;
+
+		r = _mm512_i64gather_epi64(_mm512_srli_epi64(bit, 3), buf, 1);
+		r = _mm512_and_si512(_mm512_srlv_epi64(r,
+		    _mm512_and_si512(bit, seven)), mask);
+		low = _mm512_and_si512(r, _mm512_sub_epi64(_mm512_setzero_si512(), r));
+		m = _mm512_srli_epi64(_mm512_xor_si512(r, low), 1);
+		/* e - 1 == 63 - lzcnt(low), so 1023 - e == 959 + lzcnt(low). */
+		e = _mm512_add_epi64(_mm512_lzcnt_epi64(low), ebias);
+		/* low - 1 wraps for low == 0, so this is 0 < low < 2^52. */
+		ok = _mm512_cmplt_epu64_mask(_mm512_sub_epi64(low, one), lastok);
+		_mm512_storeu_si512(out + i, _mm512_maskz_or_epi64(ok,
+		    _mm512_slli_epi64(e, 52), m));
+		bit = _mm512_add_epi64(bit, stride);
+	}
+	r0to1b_kernel_scalar(out + i, n - i, buf, pos + i * 53);
+}
+#endif
+
+static inline void
+r0to1b_fill_kernel(r0to1b_kernel kernel, double *out, size_t n)
+{
+	while (n) {
+		size_t k = (RX_BITS - rx_res.pos) / 53;
+
+		if (k == 0) {
+			/* The next number straddles a refill. */
+			*out++ = r0to1b_bits(rX(53));
+			n--;
+			continue;
+		}
+		if (k > n)
+			k = n;
+		kernel(out, k, rx_res.buf, rx_res.pos);
+		rx_res.pos += k * 53;
+		out += k;
+		n -= k;
+	}
+}
+
+static inline r0to1b_kernel
+r0to1b_best_kernel(void)
+{
+#if defined(__x86_64__) && defined(__GNUC__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512cd"))
+		return r0to1b_kernel_avx512;
+	if (__builtin_cpu_supports("avx2"))
+		return r0to1b_kernel_avx2;
+#endif
+	return r0to1b_kernel_scalar;
+}
+
+/*
+ * The kernel is picked on the first call. Two threads doing that at
+ * the same time pick the same one, but the pointer is shared, so it's
+ * read and written atomically.
+ */
+static inline void
+r0to1b_fill(double *out, size_t n)
+{
+	static r0to1b_kernel best;
+	r0to1b_kernel kernel = __atomic_load_n(&best, __ATOMIC_RELAXED);
+
+	if (kernel == NULL) {
+		kernel = r0to1b_best_kernel();
+		__atomic_store_n(&best, kernel, __ATOMIC_RELAXED);
+	}
+	r0to1b_fill_kernel(kernel, out, n);
+}
+
+/*
+ * The same thing for float. A float has a 23 bit mantissa, so
+ * r0to1bf consumes 24 bits per number, and the numbers are the
+ * multiples of 2^-24 in [0,1), just like the doubles are the multiples
+ * of 2^-53. Generating a double and converting it to float would
+ * waste 29 bits and can round numbers just below 1.0 up to 1.0f.
+ *
+ * One thing is not copied from r0to1b: it returns 0.0 when the only
+ * set bit is the top one (e == 53), which makes 0.0 twice as likely
+ * as it should be and 2^-53 impossible. Nobody will ever see that
+ * happen with 53 bits, but with 24 bits it shows up after a few
+ * million numbers. The top bit alone is simply 2^-24 and the bit
+ * fiddling below gets that right without special casing, so only
+ * r == 0 is 0.0.
+ *
+ * Since 24 bits is exactly three bytes, every number starts at the
+ * same bit offset within a byte, which makes the bulk version a bit
+ * simpler than for doubles.
+ */
+static inline float
+r0to1bf_bits(uint32_t r)
+{
+	union {
+		uint32_t u;
+		float f;
+	} res;
+	uint32_t low = r & -r;
+	int e;
+
+	if (low == 0)
+		return 0.0f;
+	e = __builtin_ctz(low) + 1;
+	res.u = ((uint32_t)(127 - e) << 23) | ((r ^ low) >> 1);
+	return res.f;
+}
+
+static inline float
+r0to1bf(void)
+{
+	uint32_t r = rX(24);
+
+	if (r == 0)
+		RX_STAT_ADD(zeros, 1);
+	return r0to1bf_bits(r);
+}
+
+typedef void (*r0to1bf_kernel)(float *, size_t, const uint64_t *, uint64_t);
+
+static inline void
+r0to1bf_kernel_scalar(float *out, size_t n, const uint64_t *buf, uint64_t pos)
+{
+	const unsigned char *b = (const unsigned char *)buf + (pos >> 3);
+	unsigned sh = pos & 7;
+	size_t i;
+
+	for (i = 0; i < n; i++, b += 3) {
+		uint32_t r;
+
+		memcpy(&r, b, sizeof(r));
+		out[i] = r0to1bf_bits((r >> sh) & ((1U << 24) - 1));
+	}
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+__attribute__((target("avx2")))
+static inline void
+r0to1bf_kernel_avx2(float *out, size_t n, const uint64_t *buf, uint64_t pos)
+{
+	const int *b = (const int *)((const unsigned char *)buf + (pos >> 3));
+	const __m128i sh = _mm_cvtsi32_si128(pos & 7);
+	const __m256i idx = _mm256_setr_epi32(0, 3, 6, 9, 12, 15, 18, 21);
+	const __m256i mask = _mm256_set1_epi32((1 << 24) - 1);
+	const __m256i ebias = _mm256_set1_epi32(253 << 23);
+	const __m256i zero = _mm256_setzero_si256();
+	size_t i;
+
+	for (i = 0; i + 8 <= n; i += 8, b = (const int *)((const char *)b + 24)) {
+		__m256i r, low, m, lowf, res;
+
+		r = _mm256_i32gather_epi32(b, idx, 1);
+		r = _mm256_and_si256(_mm256_srl_epi32(r, sh), mask);
+		low = _mm256_and_si256(r, _mm256_sub_epi32(zero, r));
+		m = _mm256_srli_epi32(_mm256_xor_si256(r, low), 1);
+		/* low is at most 2^23 and converts exactly, biased exponent 126 + e. */
+		lowf = _mm256_castps_si256(_mm256_cvtepi32_ps(low));
+		res = _mm256_or_si256(_mm256_sub_epi32(ebias, lowf), m);
+		_mm256_storeu_si256((__m256i *)(out + i), _mm256_andnot_si256(
+		    _mm256_cmpeq_epi32(low, zero), res));
+	}
+	r0to1bf_kernel_scalar(out + i, n - i, buf, pos + i * 24);
+}
+
+/*
+ * 16 floats per iteration.
+ */
+__attribute__((target("avx512f,avx512cd")))
+static inline void
+r0to1bf_kernel_avx512(float *out, size_t n, const uint64_t *buf, uint64_t pos)
+{
+	const unsigned char *b = (const unsigned char *)buf + (pos >> 3);
+	const __m128i sh = _mm_cvtsi32_si128(pos & 7);
+	const __m512i idx = _mm512_setr_epi32(0, 3, 6, 9, 12, 15, 18, 21,
+	    24, 27, 30, 33, 36, 39, 42, 45);
+	const __m512i mask = _mm512_set1_epi32((1 << 24) - 1);
+	const __m512i ebias = _mm512_set1_epi32(95);
+	size_t i;
+
+	for (i = 0; i + 16 <= n; i += 16, b += 48) {
+		__m512i r, low, m, e;
+		__mmask16 ok;
+
+		r = _mm512_i32gather_epi32(idx, b, 1);
+		r = _mm512_and_si512(_mm512_srl_epi32(r, sh), mask);
+		low = _mm512_and_si512(r, _mm512_sub_epi32(_mm512_setzero_si512(), r));
+		m = _mm512_srli_epi32(_mm512_xor_si512(r, low), 1);
+		/* e - 1 == 31 - lzcnt(low), so 127 - e == 95 + lzcnt(low). */
+		e = _mm512_add_epi32(_mm512_lzcnt_epi32(low), ebias);
+		ok = _mm512_test_epi32_mask(low, low);
+		_mm512_storeu_si512(out + i, _mm512_maskz_or_epi32(ok,
+		    _mm512_slli_epi32(e, 23), m));
+	}
+	r0to1bf_kernel_scalar(out + i, n - i, buf, pos + i * 24);
+}
+#endif
+
+static inline void
+r0to1bf_fill_kernel(r0to1bf_kernel kernel, float *out, size_t n)
+{
+	while (n) {
+		size_t k = (RX_BITS - rx_res.pos) / 24;
+
+		if (k == 0) {
+			*out++ = r0to1bf_bits(rX(24));
+			n--;
+			continue;
+		}
+		if (k > n)
+			k = n;
+		kernel(out, k, rx_res.buf, rx_res.pos);
+		rx_res.pos += k * 24;
+		out += k;
+		n -= k;
+	}
+}
+
+static inline r0to1bf_kernel
+r0to1bf_best_kernel(void)
+{
+#if defined(__x86_64__) && defined(__GNUC__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512cd"))
+		return r0to1bf_kernel_avx512;
+	if (__builtin_cpu_supports("avx2"))
+		return r0to1bf_kernel_avx2;
+#endif
+	return r0to1bf_kernel_scalar;
+}
+
+static inline void
+r0to1bf_fill(float *out, size_t n)
+{
+	static r0to1bf_kernel best;
+	r0to1bf_kernel kernel = __atomic_load_n(&best, __ATOMIC_RELAXED);
+
+	if (kernel == NULL) {
+		kernel = r0to1bf_best_kernel();
+		__atomic_store_n(&best, kernel, __ATOMIC_RELAXED);
+	}
+	r0to1bf_fill_kernel(kernel, out, n);
+}
+
+#endif /* R0TO1_H */
@@ -0,0 +1,299 @@
+/*
+ * Copyright (c) 2015 Artur Grabowski <art@blahonga.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef RX_H
+#define RX_H
+
+#include <stdlib.h>
+#include <inttypes.h>
+#include <assert.h>
+
+/*
+ * The source of random bits shared by rd.c and arbitrary_range.c.
+ *
+ * The first version of rX() called `arc4random_buf` for 8 bytes on
+ * every call and then masked away the bits it didn't need. r0to1b()
+ * needs 53 bits, so 11 bits were thrown away every time, and on some
+ * systems every call to `arc4random_buf` is a trip to the kernel. That
+ * was most of the run time of the tests.
+ *
+ * Instead we keep a reservoir of random bits, refill it 4KiB at a
+ * time and hand out exactly X bits per call. The reservoir is
+ * treated as one long stream of bits, least significant bit of the
+ * first word first. Bits left over at the end of the buffer are not
+ * thrown away, they become the low bits of the next result and the
+ * rest of the result comes from the refilled buffer.
+ */
+
+#ifdef __cplusplus
+#define RX_TLS thread_local
+#else
+#define RX_TLS _Thread_local
+#endif
+
+#define RX_WORDS 512			/* 4KiB per refill. */
+#define RX_BITS (RX_WORDS * 64)
+
+/*
+ * The extra word at the end of buf is never filled, it's there so
+ * that bulk consumers can do 8 byte loads for bits near the end of
+ * the buffer without reading past it.
+ *
+ * Every thread has its own reservoir and its own source, so threads
+ * never share bits and never need locks.
+ */
+static RX_TLS struct rx_reservoir {
+	uint64_t buf[RX_WORDS + 1];
+	uint64_t pos;			/* Next unused bit in buf. */
+} rx_res = { { 0 }, RX_BITS };
+
+/*
+ * Where the bits come from. `fill` writes n random words to buf, n is
+ * always RX_WORDS. The default is `arc4random_buf`, faster (and
+ * reproducible) sources are in rX_sources.h.
+ */
+struct rx_source {
+	void (*fill)(void *arg, uint64_t *buf, size_t n);
+	void *arg;
+};
+
+/*
+ * If your operating system does not provide `arc4random_buf` get
+ * a better operating system or substitute this function for your
+ * favourite randomness source.
+ */
+static inline void
+rx_arc4random_fill(void *arg, uint64_t *buf, size_t n)
+{
+	(void)arg;
+	arc4random_buf(buf, n * sizeof(*buf));
+}
+
+static RX_TLS struct rx_source rx_src = { rx_arc4random_fill, NULL };
+
+/*
+ * Counters for what the random bits are spent on, so that we can see
+ * in a running program how many bits every number actually costs:
+ *
+ *  - bits_requested: bits handed out by rX() and the bulk fills,
+ *  - bits_discarded: bits thrown away when the source was switched,
+ *  - refills: calls to the source, RX_BITS bits each,
+ *  - rejections: extra rounds of r_uniform and friends,
+ *  - zeros: times r0to1b and friends took the 0.0 branch (only the
+ *    single number versions, the bulk fills don't branch).
+ *
+ * They only exist when compiled with -DRX_STATS (and -pthread),
+ * otherwise RX_STAT_ADD expands to nothing and rx_stats_snapshot
+ * returns zeroes.
+ *
+ * Every thread counts in its own cache line, with plain adds since
+ * it's the only writer. rx_stats_snapshot adds up all the threads
+ * (and the ones that have exited) and can be called from any thread
+ * at any time, the numbers are just not taken at the same instant.
+ * The registry is per translation unit, like everything else here.
+ *
+ * bits_requested is not counted in rX() itself. An add and a store on
+ * every call made the single number generators up to 9% slower, and
+ * the position in the reservoir already says how many bits have been
+ * handed out. So a refill counts the whole buffer it replaces and
+ * rx_stats_snapshot adds the current position of the thread that
+ * calls it. The other threads are counted as of their last refill, up
+ * to RX_BITS bits behind.
+ */
+struct rx_stats {
+	uint64_t bits_requested;
+	uint64_t bits_discarded;
+	uint64_t refills;
+	uint64_t rejections;
+	uint64_t zeros;
+};
+
+#ifdef RX_STATS
+#include <pthread.h>
+
+struct rx_stats_slot {
+	struct rx_stats st;
+	struct rx_stats_slot *next, **prevp;
+} __attribute__((aligned(64)));
+
+static RX_TLS struct rx_stats_slot rx_st;
+static struct rx_stats_slot *rx_stats_list;
+static struct rx_stats rx_stats_exited;
+static pthread_mutex_t rx_stats_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t rx_stats_once = PTHREAD_ONCE_INIT;
+static pthread_key_t rx_stats_key;
+
+/* Relaxed atomics so that rx_stats_snapshot doesn't race, no locked instructions. */
+#define RX_STAT_ADD(f, n) \
+	__atomic_store_n(&rx_st.st.f, rx_st.st.f + (n), __ATOMIC_RELAXED)
+
+static inline void
+rx_stats_sum(struct rx_stats *to, const struct rx_stats *from)
+{
+	to->bits_requested += __atomic_load_n(&from->bits_requested, __ATOMIC_RELAXED);
+	to->bits_discarded += __atomic_load_n(&from->bits_discarded, __ATOMIC_RELAXED);
+	to->refills += __atomic_load_n(&from->refills, __ATOMIC_RELAXED);
+	to->rejections += __atomic_load_n(&from->rejections, __ATOMIC_RELAXED);
+	to->zeros += __atomic_load_n(&from->zeros, __ATOMIC_RELAXED);
+}
+
+static inline void
+rx_stats_exit(void *arg)
+{
+	struct rx_stats_slot *sl = (struct rx_stats_slot *)arg;
+
+	/* Runs in the exiting thread, so rx_res is its reservoir. */
+	RX_STAT_ADD(bits_requested, rx_res.pos);
+	pthread_mutex_lock(&rx_stats_mtx);
+	rx_stats_sum(&rx_stats_exited, &sl->st);
+	if (sl->next)
+		sl->next->prevp = sl->prevp;
+	*sl->prevp = sl->next;
+	pthread_mutex_unlock(&rx_stats_mtx);
+}
+
+static inline void
+rx_stats_init(void)
+{
+	pthread_key_create(&rx_stats_key, rx_stats_exit);
+}
+
+static inline void
+rx_stats_register(void)
+{
+	pthread_once(&rx_stats_once, rx_stats_init);
+	pthread_mutex_lock(&rx_stats_mtx);
+	rx_st.next = rx_stats_list;
+	if (rx_st.next)
+		rx_st.next->prevp = &rx_st.next;
+	rx_st.prevp = &rx_stats_list;
+	rx_stats_list = &rx_st;
+	pthread_mutex_unlock(&rx_stats_mtx);
+	pthread_setspecific(rx_stats_key, &rx_st);
+}
+
+/*
+ * Called from rX_refill, every thread refills before it can count
+ * anything else. Until the first refill the reservoir is empty and
+ * nothing has been handed out from it, after that rX() has handed out
+ * all of it, the last few bits as the low bits of the number that
+ * needed the refill.
+ */
+static inline void
+rx_stats_refill(void)
+{
+	if (rx_st.prevp)
+		RX_STAT_ADD(bits_requested, RX_BITS);
+	else
+		rx_stats_register();
+	RX_STAT_ADD(refills, 1);
+}
+
+static inline void
+rx_stats_snapshot(struct rx_stats *st)
+{
+	struct rx_stats_slot *sl;
+	struct rx_stats z = { 0 };
+
+	*st = z;
+	pthread_mutex_lock(&rx_stats_mtx);
+	rx_stats_sum(st, &rx_stats_exited);
+	for (sl = rx_stats_list; sl; sl = sl->next)
+		rx_stats_sum(st, &sl->st);
+	pthread_mutex_unlock(&rx_stats_mtx);
+	if (rx_st.prevp)
+		st->bits_requested += rx_res.pos;
+}
+#else
+#define RX_STAT_ADD(f, n) do { } while (0)
+#define rx_stats_refill() do { } while (0)
+
+static inline void
+rx_stats_snapshot(struct rx_stats *st)
+{
+	struct rx_stats z = { 0 };
+
+	*st = z;
+}
+#endif
+
+/*
+ * Switch to a different source. The bits left in the reservoir came
+ * from the old source, so they are thrown away and the next rX()
+ * starts at the beginning of the new stream.
+ */
+static inline void
+rX_source(void (*fill)(void *, uint64_t *, size_t), void *arg)
+{
+	/* The next refill counts all of the buffer as handed out. */
+	RX_STAT_ADD(bits_requested, rx_res.pos - RX_BITS);
+	RX_STAT_ADD(bits_discarded, RX_BITS - rx_res.pos);
+	rx_src.fill = fill;
+	rx_src.arg = arg;
+	rx_res.pos = RX_BITS;
+}
+
+static void
+rX_refill(void)
+{
+	rx_stats_refill();
+	rx_src.fill(rx_src.arg, rx_res.buf, RX_WORDS);
+	rx_res.pos = 0;
+}
+
+/*
+ * X bits that are known to be in the buffer.
+ */
+static inline uint64_t
+rX_take(uint64_t X)
+{
+	uint64_t res, w, off;
+
+	w = rx_res.pos >> 6;
+	off = rx_res.pos & 63;
+	res = rx_res.buf[w] >> off;
+	/* off can't be 0 here, so the shift is defined. */
+	if (off + X > 64)
+		res |= rx_res.buf[w + 1] << (64 - off);
+	rx_res.pos += X;
+
+	if (X == 64)
+		return res;
+	return res & ((1ULL << X) - 1);
+}
+
+/*
+ * Returns a number in the range [0,2^X) for 0 < X <= 64.
+ */
+static uint64_t
+rX(uint64_t X)
+{
+	uint64_t avail, res;
+
+	assert(X > 0 && X < 65);
+
+	avail = RX_BITS - rx_res.pos;
+	if (avail < X) {
+		res = 0;
+		if (avail)
+			res = rx_res.buf[RX_WORDS - 1] >> (64 - avail);
+		rX_refill();
+		return res | (rX_take(X - avail) << avail);
+	}
+	return rX_take(X);
+}
+
+#endif /* RX_H */
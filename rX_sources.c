@@ -0,0 +1,345 @@
+/*
+ * Copyright (c) 2015 Artur Grabowski <art@blahonga.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <assert.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "rX.h"
+#include "rX_sources.h"
+#include "r0to1.h"
+
+/*
+ * The generators in rX_sources.h are only useful if they generate
+ * what they claim to generate. Check them against the published test
+ * vectors and then see how fast they can fill the rX() buffer.
+ */
+
+static void
+check_words(const char *name, const uint64_t *got, const uint64_t *expected, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		if (got[i] != expected[i]) {
+			printf("%s[%d]: 0x%016" PRIx64 ", expected 0x%016" PRIx64 "\n",
+			    name, i, got[i], expected[i]);
+			abort();
+		}
+	}
+}
+
+/*
+ * RFC 7539 2.3.2. The IETF layout has a 32 bit counter and a 96 bit
+ * nonce, the first word of the nonce is the high half of our counter.
+ */
+static void
+test_chacha20(void)
+{
+	const uint32_t key[8] = {
+		0x03020100, 0x07060504, 0x0b0a0908, 0x0f0e0d0c,
+		0x13121110, 0x17161514, 0x1b1a1918, 0x1f1e1d1c,
+	};
+	const uint64_t expected[8] = {
+		0x15593bd1e4e7f110ULL, 0xc47120a31fdd0f50ULL,
+		0x0368c033c7f4d1c7ULL, 0x4e6cd4c39aaa2204ULL,
+		0x09aa9f07466482d2ULL, 0xa2028bd905d7c214ULL,
+		0xb94e16ded19c12b5ULL, 0x4e3c50a2e883d0cbULL,
+	};
+	struct rx_chacha c;
+	uint64_t buf[32];
+
+	rx_chacha_init(&c, key, 0x4a000000, 20);
+	rx_chacha_seek(&c, 1 | (0x09000000ULL << 32));
+	rx_chacha_fill(&c, buf, 32);
+	check_words("chacha20", buf, expected, 8);
+}
+
+/*
+ * All zero key and nonce, block 0, for 20 and 8 rounds. Also checks
+ * that the four lanes end up in the right order by looking at the
+ * second block.
+ */
+static void
+test_chacha_zero(void)
+{
+	const uint32_t key[8] = { 0 };
+	const uint64_t expected20[8] = {
+		0x903df1a0ade0b876ULL, 0x28bd8653e56a5d40ULL,
+		0x1aed8da0b819d2bdULL, 0xc70d778bccef36a8ULL,
+		0x8d4857517c5941daULL, 0x374ad8b83fe02477ULL,
+		0x1ca11815f4b8436aULL, 0x8665eeb269b687c3ULL,
+	};
+	const uint64_t expected8[8] = {
+		0xd6405f892fef003eULL, 0xa1a5091fe8b85b7fULL,
+		0x3b7f9acec30e842cULL, 0x1e1a71ef88e11b18ULL,
+		0x416f21b972e14c98ULL, 0x19566d456753449fULL,
+		0x01b086daa3424a31ULL, 0x42fe0c0eb8fd7b38ULL,
+	};
+	struct rx_chacha c;
+	uint64_t buf[32], second[32];
+
+	rx_chacha_init(&c, key, 0, 20);
+	rx_chacha_fill(&c, buf, 32);
+	check_words("chacha20(0)", buf, expected20, 8);
+
+	rx_chacha_init(&c, key, 0, 20);
+	rx_chacha_seek(&c, 1);
+	rx_chacha_fill(&c, second, 32);
+	check_words("chacha20(lanes)", buf + 8, second, 24);
+
+	rx_chacha_init(&c, key, 0, 8);
+	rx_chacha_fill(&c, buf, 32);
+	check_words("chacha8(0)", buf, expected8, 8);
+}
+
+/*
+ * Known answers from the Random123 distribution, kat_vectors.
+ */
+static void
+test_philox(void)
+{
+	const uint64_t expected0[4] = {
+		0x16554d9eca36314cULL, 0xdb20fe9d672d0fdcULL,
+		0xd7e772cee186176bULL, 0x7e68b68aec7ba23bULL,
+	};
+	const uint64_t ctrpi[4] = {
+		0x243f6a8885a308d3ULL, 0x13198a2e03707344ULL,
+		0xa4093822299f31d0ULL, 0x082efa98ec4e6c89ULL,
+	};
+	const uint64_t keypi[2] = {
+		0x452821e638d01377ULL, 0xbe5466cf34e90c6cULL,
+	};
+	const uint64_t expectedpi[4] = {
+		0xa528f45403e61d95ULL, 0x38c72dbd566e9788ULL,
+		0xa5a1610e72fd18b5ULL, 0x57bd43b5e52b7fe6ULL,
+	};
+	const uint64_t zero[4] = { 0 };
+	uint64_t out[4];
+
+	rx_philox_block(zero, zero, out);
+	check_words("philox(0)", out, expected0, 4);
+	rx_philox_block(ctrpi, keypi, out);
+	check_words("philox(pi)", out, expectedpi, 4);
+}
+
+/*
+ * FIPS-197 appendix C.1.
+ */
+static void
+test_aes(void)
+{
+#if defined(__x86_64__) && defined(__GNUC__)
+	const uint8_t key[16] = {
+		0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+		0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f,
+	};
+	const uint8_t pt[16] = {
+		0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77,
+		0x88, 0x99, 0xaa, 0xbb, 0xcc, 0xdd, 0xee, 0xff,
+	};
+	const uint8_t ct[16] = {
+		0x69, 0xc4, 0xe0, 0xd8, 0x6a, 0x7b, 0x04, 0x30,
+		0xd8, 0xcd, 0xb7, 0x80, 0x70, 0xb4, 0xc5, 0x5a,
+	};
+	struct rx_aes a;
+	uint64_t out[2], expected[2], ctrblock[16];
+
+	if (rx_aes_init(&a, key, 0) == -1) {
+		printf("aes: no AES-NI, skipping\n");
+		return;
+	}
+	rx_aes_encrypt(&a, pt, out);
+	memcpy(expected, ct, sizeof(ct));
+	check_words("aes", out, expected, 2);
+
+	/* Counter mode is just encrypting the counters. */
+	rx_aes_seek(&a, 5);
+	rx_aes_fill(&a, ctrblock, 16);
+	memcpy(out, (uint64_t[2]){ 7, 0 }, sizeof(out));
+	rx_aes_encrypt(&a, out, expected);
+	check_words("aes-ctr", ctrblock + 4, expected, 2);
+#endif
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+ * Save some ChaCha8 to a file and check that the mmap source gives us
+ * the same bits back through rX(), with draws of every size so that
+ * they cross the refills at every offset, and that rx_mmap_eof turns
+ * on at exactly the last bit of the file. The file doesn't end on a
+ * word boundary to check the padding too. An empty file is refused.
+ *
+ * Then replay a bigger file with r0to1b_fill to see how fast it is.
+ */
+static void
+test_mmap(void)
+{
+	const uint32_t key[8] = { 0x6d6d6170 };
+	const size_t words = 3 * RX_WORDS + 5, bytes = words * 8 + 3;
+	const size_t bigwords = (64 << 20) / 8;
+	char path[] = "/tmp/rX_mmap.XXXXXX";
+	static uint64_t buf[4 * RX_WORDS];
+	static double d[RX_WORDS];
+	struct rx_chacha c;
+	struct rx_mmap m;
+	uint64_t bits, X, a, b;
+	size_t i;
+	FILE *f;
+	double t;
+	int fd;
+
+	if ((fd = mkstemp(path)) == -1 || (f = fdopen(fd, "w")) == NULL) {
+		perror(path);
+		abort();
+	}
+	rx_chacha_init(&c, key, 0, 8);
+	rx_chacha_fill(&c, buf, 4 * RX_WORDS);
+	if (fwrite(buf, 1, bytes, f) != bytes || fclose(f)) {
+		perror(path);
+		abort();
+	}
+
+	if (rx_mmap_open(&m, path) == -1) {
+		perror(path);
+		abort();
+	}
+	/* The padding is zeroes, so ChaCha has to match only up to the end. */
+	memset((unsigned char *)buf + bytes, 0, sizeof(buf) - bytes);
+	rx_chacha_init(&c, key, 0, 8);
+	rX_source(rx_mmap_fill, &m);
+	for (bits = 0, X = 1; bits + 64 <= bytes * 8; bits += X, X = X % 64 + 1) {
+		a = rX(X);
+		b = buf[bits / 64] >> (bits % 64);
+		if (bits % 64 + X > 64)
+			b |= buf[bits / 64 + 1] << (64 - bits % 64);
+		if (X < 64)
+			b &= (1ULL << X) - 1;
+		if (a != b) {
+			printf("mmap[bit %" PRIu64 "](%" PRIu64 "): 0x%" PRIx64
+			    ", expected 0x%" PRIx64 "\n", bits, X, a, b);
+			abort();
+		}
+		assert(!rx_mmap_eof(&m));
+	}
+	while (bits < bytes * 8) {
+		assert(!rx_mmap_eof(&m));
+		rX(1);
+		bits++;
+	}
+	assert(!rx_mmap_eof(&m));
+	rX(1);
+	assert(rx_mmap_eof(&m));
+	rx_mmap_close(&m);
+
+	if ((f = fopen(path, "w")) == NULL || fclose(f)) {
+		perror(path);
+		abort();
+	}
+	assert(rx_mmap_open(&m, path) == -1 && errno == EINVAL);
+
+	/* Bigger file for the speed. */
+	if ((f = fopen(path, "w")) == NULL) {
+		perror(path);
+		abort();
+	}
+	for (i = 0; i < bigwords; i += RX_WORDS) {
+		rx_chacha_fill(&c, buf, RX_WORDS);
+		fwrite(buf, sizeof(buf[0]), RX_WORDS, f);
+	}
+	if (fclose(f) || rx_mmap_open(&m, path) == -1) {
+		perror(path);
+		abort();
+	}
+	unlink(path);
+	rX_source(rx_mmap_fill, &m);
+	t = now();
+	while (!rx_mmap_eof(&m))
+		r0to1b_fill(d, RX_WORDS);
+	t = now() - t;
+	printf("%-10s %8.1f MB/s r0to1b_fill %6.2f ns/double\n", "mmap",
+	    bigwords * 8 / t / 1e6, t * 1e9 / (bigwords * 64.0 / 53));
+	rx_mmap_close(&m);
+	rX_source(rx_arc4random_fill, NULL);
+}
+
+/*
+ * How fast can each source generate bits, and how fast is r0to1b_fill
+ * on top of it.
+ */
+static void
+speed(const char *name, void (*fill)(void *, uint64_t *, size_t), void *arg)
+{
+	static uint64_t buf[RX_WORDS];
+	static double d[RX_WORDS];
+	const int loops = 1 << 14;
+	double t;
+	int i;
+
+	t = now();
+	for (i = 0; i < loops; i++)
+		fill(arg, buf, RX_WORDS);
+	t = now() - t;
+	printf("%-10s %8.1f MB/s", name, loops * sizeof(buf) / t / 1e6);
+
+	rX_source(fill, arg);
+	t = now();
+	for (i = 0; i < loops; i++)
+		r0to1b_fill(d, RX_WORDS);
+	t = now() - t;
+	printf(" r0to1b_fill %6.2f ns/double\n", t * 1e9 / ((double)loops * RX_WORDS));
+}
+
+int
+main(int argc, char **argv)
+{
+	const uint32_t key32[8] = { 1, 2, 3, 4, 5, 6, 7, 8 };
+	const uint64_t key64[2] = { 1, 2 };
+	struct rx_chacha c8, c20;
+	struct rx_philox p;
+
+	test_chacha20();
+	test_chacha_zero();
+	test_philox();
+	test_aes();
+	test_mmap();
+
+	speed("arc4random", rx_arc4random_fill, NULL);
+	rx_chacha_init(&c8, key32, 0, 8);
+	speed("chacha8", rx_chacha_fill, &c8);
+	rx_chacha_init(&c20, key32, 0, 20);
+	speed("chacha20", rx_chacha_fill, &c20);
+	rx_philox_init(&p, key64, 0);
+	speed("philox", rx_philox_fill, &p);
+#if defined(__x86_64__) && defined(__GNUC__)
+	struct rx_aes a;
+	if (rx_aes_init(&a, (const uint8_t *)key32, 0) == 0)
+		speed("aes-ctr", rx_aes_fill, &a);
+#endif
+	return 0;
+}
@@ -0,0 +1,406 @@
+/*
+ * Copyright (c) 2015 Artur Grabowski <art@blahonga.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef RX_SOURCES_H
+#define RX_SOURCES_H
+
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "rX.h"
+
+/*
+ * Sources of random bits for rX() other than `arc4random_buf`.
+ *
+ * `arc4random_buf` is a fine default, but depending on the operating
+ * system it can be a locked getrandom(2) call, which means that no
+ * matter how clever the code above it is we generate numbers at
+ * syscall speed. These are all keyed counter mode generators, they
+ * need no syscalls or locks, they can be seeded to replay the same
+ * stream of bits and they are fast enough that refilling the rX()
+ * buffer is limited by memory bandwidth and not by the generator.
+ *
+ * Use them like this:
+ *
+ *	struct rx_chacha c;
+ *	rx_chacha_init(&c, key, 0, 8);
+ *	rX_source(rx_chacha_fill, &c);
+ *
+ * after which everything that uses rX() draws from ChaCha8.
+ */
+
+/*
+ * ChaCha with 8, 12 or 20 rounds. 256 bit key, 64 bit block counter
+ * and 64 bit nonce, the original layout from the ChaCha paper and not
+ * the IETF one with the 32 bit counter.
+ *
+ * Four blocks are computed at the same time with one block per lane
+ * of a 4 x 32 bit vector. The vector extensions are understood by gcc
+ * and clang on every architecture and become SSE2 or NEON where they
+ * exist.
+ */
+struct rx_chacha {
+	uint32_t s[16];
+	int rounds;
+};
+
+static inline void
+rx_chacha_init(struct rx_chacha *c, const uint32_t key[8], uint64_t nonce, int rounds)
+{
+	assert(rounds > 0 && rounds % 2 == 0);
+	c->s[0] = 0x61707865;	/* "expand 32-byte k" */
+	c->s[1] = 0x3320646e;
+	c->s[2] = 0x79622d32;
+	c->s[3] = 0x6b206574;
+	memcpy(&c->s[4], key, 8 * sizeof(uint32_t));
+	c->s[12] = 0;
+	c->s[13] = 0;
+	c->s[14] = nonce;
+	c->s[15] = nonce >> 32;
+	c->rounds = rounds;
+}
+
+static inline void
+rx_chacha_seek(struct rx_chacha *c, uint64_t block)
+{
+	c->s[12] = block;
+	c->s[13] = block >> 32;
+}
+
+typedef uint32_t rx_v4u32 __attribute__((vector_size(16)));
+
+#define RX_ROTL(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+#define RX_QR(a, b, c, d) do {				\
+	a += b; d ^= a; d = RX_ROTL(d, 16);		\
+	c += d; b ^= c; b = RX_ROTL(b, 12);		\
+	a += b; d ^= a; d = RX_ROTL(d, 8);		\
+	c += d; b ^= c; b = RX_ROTL(b, 7);		\
+} while (0)
+
+/* n must be a multiple of 32, four blocks of 8 words. */
+static inline void
+rx_chacha_fill(void *arg, uint64_t *buf, size_t n)
+{
+	struct rx_chacha *c = (struct rx_chacha *)arg;
+	uint32_t *out = (uint32_t *)buf;
+	size_t blk;
+
+	assert(n % 32 == 0);
+
+	for (blk = 0; blk < n / 8; blk += 4) {
+		rx_v4u32 in[16], x[16];
+		uint64_t ctr = c->s[12] | (uint64_t)c->s[13] << 32;
+		int i, j;
+
+		for (i = 0; i < 16; i++)
+			in[i] = (rx_v4u32){ c->s[i], c->s[i], c->s[i], c->s[i] };
+		for (j = 0; j < 4; j++) {
+			in[12][j] = ctr + j;
+			in[13][j] = (ctr + j) >> 32;
+		}
+		ctr += 4;
+		c->s[12] = ctr;
+		c->s[13] = ctr >> 32;
+
+		memcpy(x, in, sizeof(x));
+		for (i = 0; i < c->rounds; i += 2) {
+			RX_QR(x[0], x[4], x[8], x[12]);
+			RX_QR(x[1], x[5], x[9], x[13]);
+			RX_QR(x[2], x[6], x[10], x[14]);
+			RX_QR(x[3], x[7], x[11], x[15]);
+			RX_QR(x[0], x[5], x[10], x[15]);
+			RX_QR(x[1], x[6], x[11], x[12]);
+			RX_QR(x[2], x[7], x[8], x[13]);
+			RX_QR(x[3], x[4], x[9], x[14]);
+		}
+		for (i = 0; i < 16; i++)
+			x[i] += in[i];
+		/* Lanes are blocks, transpose back to the keystream order. */
+		for (j = 0; j < 4; j++)
+			for (i = 0; i < 16; i++)
+				out[(blk + j) * 16 + i] = x[i][j];
+	}
+}
+
+#undef RX_QR
+#undef RX_ROTL
+
+/*
+ * Philox4x64-10 from "Parallel Random Numbers: As Easy as 1, 2, 3" by
+ * Salmon et al. A 256 bit counter and a 128 bit key, each block of
+ * output is just ten rounds of multiplications of the counter, so
+ * any block can be computed without computing the ones before it.
+ */
+struct rx_philox {
+	uint64_t ctr[4];
+	uint64_t key[2];
+};
+
+static inline void
+rx_philox_init(struct rx_philox *p, const uint64_t key[2], uint64_t nonce)
+{
+	p->key[0] = key[0];
+	p->key[1] = key[1];
+	p->ctr[0] = 0;
+	p->ctr[1] = 0;
+	p->ctr[2] = nonce;
+	p->ctr[3] = 0;
+}
+
+static inline void
+rx_philox_seek(struct rx_philox *p, uint64_t block)
+{
+	p->ctr[0] = block;
+	p->ctr[1] = 0;
+}
+
+static inline void
+rx_philox_block(const uint64_t ctr[4], const uint64_t key[2], uint64_t out[4])
+{
+	uint64_t x0 = ctr[0], x1 = ctr[1], x2 = ctr[2], x3 = ctr[3];
+	uint64_t k0 = key[0], k1 = key[1];
+	int i;
+
+	for (i = 0; i < 10; i++) {
+		unsigned __int128 p0 = (unsigned __int128)0xD2E7470EE14C6C93ULL * x0;
+		unsigned __int128 p1 = (unsigned __int128)0xCA5A826395121157ULL * x2;
+
+		x0 = (uint64_t)(p1 >> 64) ^ x1 ^ k0;
+		x1 = (uint64_t)p1;
+		x2 = (uint64_t)(p0 >> 64) ^ x3 ^ k1;
+		x3 = (uint64_t)p0;
+		k0 += 0x9E3779B97F4A7C15ULL;
+		k1 += 0xBB67AE8584CAA73BULL;
+	}
+	out[0] = x0;
+	out[1] = x1;
+	out[2] = x2;
+	out[3] = x3;
+}
+
+/* n must be a multiple of 4. */
+static inline void
+rx_philox_fill(void *arg, uint64_t *buf, size_t n)
+{
+	struct rx_philox *p = (struct rx_philox *)arg;
+	size_t i;
+
+	assert(n % 4 == 0);
+
+	for (i = 0; i < n; i += 4) {
+		rx_philox_block(p->ctr, p->key, buf + i);
+		if (++p->ctr[0] == 0)
+			p->ctr[1]++;
+	}
+}
+
+/*
+ * AES-128 in counter mode with AES-NI. Eight blocks are in flight at
+ * the same time to keep the AES units busy. The counter is the low
+ * 64 bits of the block, the nonce is the high 64 bits.
+ *
+ * rx_aes_init returns -1 if the CPU can't do AES-NI.
+ */
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+
+struct rx_aes {
+	__m128i rk[11];
+	uint64_t ctr;
+	uint64_t nonce;
+};
+
+__attribute__((target("aes")))
+static inline __m128i
+rx_aes_expand(__m128i k, __m128i kg)
+{
+	kg = _mm_shuffle_epi32(kg, 0xff);
+	k = _mm_xor_si128(k, _mm_slli_si128(k, 4));
+	k = _mm_xor_si128(k, _mm_slli_si128(k, 4));
+	k = _mm_xor_si128(k, _mm_slli_si128(k, 4));
+	return _mm_xor_si128(k, kg);
+}
+
+__attribute__((target("aes")))
+static inline int
+rx_aes_init(struct rx_aes *a, const uint8_t key[16], uint64_t nonce)
+{
+	__m128i *rk = a->rk;
+
+	__builtin_cpu_init();
+	if (!__builtin_cpu_supports("aes"))
+		return -1;
+
+	/* aeskeygenassist wants its round constant as an immediate. */
+	rk[0] = _mm_loadu_si128((const __m128i *)key);
+	rk[1] = rx_aes_expand(rk[0], _mm_aeskeygenassist_si128(rk[0], 0x01));
+	rk[2] = rx_aes_expand(rk[1], _mm_aeskeygenassist_si128(rk[1], 0x02));
+	rk[3] = rx_aes_expand(rk[2], _mm_aeskeygenassist_si128(rk[2], 0x04));
+	rk[4] = rx_aes_expand(rk[3], _mm_aeskeygenassist_si128(rk[3], 0x08));
+	rk[5] = rx_aes_expand(rk[4], _mm_aeskeygenassist_si128(rk[4], 0x10));
+	rk[6] = rx_aes_expand(rk[5], _mm_aeskeygenassist_si128(rk[5], 0x20));
+	rk[7] = rx_aes_expand(rk[6], _mm_aeskeygenassist_si128(rk[6], 0x40));
+	rk[8] = rx_aes_expand(rk[7], _mm_aeskeygenassist_si128(rk[7], 0x80));
+	rk[9] = rx_aes_expand(rk[8], _mm_aeskeygenassist_si128(rk[8], 0x1b));
+	rk[10] = rx_aes_expand(rk[9], _mm_aeskeygenassist_si128(rk[9], 0x36));
+	a->ctr = 0;
+	a->nonce = nonce;
+	return 0;
+}
+
+static inline void
+rx_aes_seek(struct rx_aes *a, uint64_t block)
+{
+	a->ctr = block;
+}
+
+__attribute__((target("aes")))
+static inline void
+rx_aes_encrypt(const struct rx_aes *a, const void *in, void *out)
+{
+	__m128i b = _mm_xor_si128(_mm_loadu_si128((const __m128i *)in), a->rk[0]);
+	int r;
+
+	for (r = 1; r < 10; r++)
+		b = _mm_aesenc_si128(b, a->rk[r]);
+	_mm_storeu_si128((__m128i *)out, _mm_aesenclast_si128(b, a->rk[10]));
+}
+
+/* n must be a multiple of 16, eight blocks of 2 words. */
+__attribute__((target("aes")))
+static inline void
+rx_aes_fill(void *arg, uint64_t *buf, size_t n)
+{
+	struct rx_aes *a = (struct rx_aes *)arg;
+	size_t i;
+	int j, r;
+
+	assert(n % 16 == 0);
+
+	for (i = 0; i < n; i += 16) {
+		__m128i b[8];
+
+		for (j = 0; j < 8; j++)
+			b[j] = _mm_xor_si128(_mm_set_epi64x(a->nonce, a->ctr + j), a->rk[0]);
+		for (r = 1; r < 10; r++)
+			for (j = 0; j < 8; j++)
+				b[j] = _mm_aesenc_si128(b[j], a->rk[r]);
+		for (j = 0; j < 8; j++)
+			_mm_storeu_si128((__m128i *)(buf + i) + j,
+			    _mm_aesenclast_si128(b[j], a->rk[10]));
+		a->ctr += 8;
+	}
+}
+#endif
+
+/*
+ * Not a generator: the bits come from a file, so that a stream of
+ * bits saved from somewhere else can be fed through rX() again and
+ * give us exactly the same numbers. The file is read as 64 bit words
+ * in native byte order, so the bits of a file written from a buffer
+ * filled by any of the sources above come out of rX() in the order
+ * the source put them in.
+ *
+ * The file is mapped and read sequentially. Every refill still copies
+ * 4KiB into the rX() reservoir, the consumers of the reservoir depend
+ * on it being there, but that copy is from memory to L1 and costs
+ * nothing next to the page faults. MADV_SEQUENTIAL makes the kernel
+ * read ahead aggressively and drop the pages we're done with.
+ *
+ * When the file runs out the rest of the reservoir is filled with
+ * zeroes. rx_mmap_eof tells if rX() has handed out any of those bits,
+ * which is how the replay knows that the last number it got wasn't
+ * from the file. It has to be called from the thread that uses the
+ * source, the reservoir is per thread. An empty file has nothing to
+ * replay and rx_mmap_open fails with EINVAL.
+ */
+struct rx_mmap {
+	const unsigned char *p;
+	size_t len;			/* Bytes in the file. */
+	size_t off;			/* Next byte to copy. */
+	uint64_t words;			/* Words given to rX(), padding included. */
+};
+
+static inline int
+rx_mmap_open(struct rx_mmap *m, const char *path)
+{
+	struct stat sb;
+	void *p;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) == -1)
+		return -1;
+	if (fstat(fd, &sb) == -1) {
+		close(fd);
+		return -1;
+	}
+	if (sb.st_size == 0) {
+		close(fd);
+		errno = EINVAL;
+		return -1;
+	}
+	p = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (p == MAP_FAILED) {
+		close(fd);
+		return -1;
+	}
+	madvise(p, sb.st_size, MADV_SEQUENTIAL);
+	close(fd);
+	m->p = (const unsigned char *)p;
+	m->len = sb.st_size;
+	m->off = 0;
+	m->words = 0;
+	return 0;
+}
+
+static inline void
+rx_mmap_close(struct rx_mmap *m)
+{
+	if (m->len)
+		munmap((void *)m->p, m->len);
+	m->p = NULL;
+	m->len = 0;
+}
+
+static inline void
+rx_mmap_fill(void *arg, uint64_t *buf, size_t n)
+{
+	struct rx_mmap *m = (struct rx_mmap *)arg;
+	size_t want = n * sizeof(*buf);
+	size_t have = m->len - m->off < want ? m->len - m->off : want;
+
+	if (have)
+		memcpy(buf, m->p + m->off, have);
+	memset((unsigned char *)buf + have, 0, want - have);
+	m->off += have;
+	m->words += n;
+}
+
+static inline int
+rx_mmap_eof(const struct rx_mmap *m)
+{
+	if (m->words == 0)
+		return 0;
+	return (m->words - RX_WORDS) * 64 + rx_res.pos > (uint64_t)m->len * 8;
+}
+
+#endif /* RX_SOURCES_H */
@@ -21,6 +21,10 @@
 #include <assert.h>
 #include <strings.h>
 
+#include "rX.h"
+#include "rX_sources.h"
+#include "r0to1.h"
+
 /*
  * I need to generate floating point doubles in the range [0,1) that
  * are uniformly distributed. The distribution isn't allowed to be
@@ -39,22 +43,13 @@
  * Assume that my source of random bits is perfect and is a function
  * that returns a number in the range [0,2^X) and looks like this (for
  * X <= 64):
- */
-static uint64_t
-rX(uint64_t X)
-{
-	uint64_t res;
-	assert(X > 0 && X < 65);
-	arc4random_buf(&res, sizeof(res));
-	if (X == 64)
-		return res;
-	return res & ((1ULL << X) - 1);
-}
-
-/*
- * If your operating system does not provide `arc4random_buf` get
- * a better operating system or substitute this function for your
- * favourite randomness source.
+ *
+ *	uint64_t rX(uint64_t X);
+ *
+ * It lives in rX.h because arbitrary_range.c needs it too. It hands
+ * out exactly X bits from a buffer of random bits that gets refilled
+ * from `arc4random_buf`, so r0to1b() below consumes 53 bits and not
+ * a whole 64 bit word.
  */
 
 /*
@@ -183,8 +178,10 @@ r0to1(void)
 	uint64_t m;
 
 	e = ffsll(rX(52));
-	if (e == 0)
+	if (e == 0) {
+		RX_STAT_ADD(zeros, 1);
 		return 0.0;
+	}
 	m = rX(52 - e + 1) << (e - 1);
 	return ldexp(0x1p52 + m, -52 - e);
 }
@@ -206,13 +203,71 @@ r0to1b(void)
 	uint64_t r = rX(53);
 	int e = ffsll(r);
 	uint64_t m;
-	if (e > 52 || e == 0)
+	if (e > 52 || e == 0) {
+		RX_STAT_ADD(zeros, 1);
 		return 0.0;
+	}
 	/* Shift out the bit we don't want set. */
 	m = (r >> e) << (e - 1);
 	return ldexp(0x1p52 + m, -52 - e);
 }
 
+/*
+ * r0to1b returns 0.0 when none of the low 52 bits is set, which
+ * happens with probability 2^-52. That's the probability of a number
+ * in [0,2^-52), and all the numbers in that range (including every
+ * subnormal) are never generated, they're all squashed into 0.0.
+ *
+ * But when that happens we know that the number is in [0,2^-52) and
+ * we know nothing else about it, so we can just pick a number in that
+ * range the same way: r0to1b again, scaled by 2^-52. Every level
+ * consumes 53 bits and is needed with probability 2^-52, so the
+ * average stays at 53 bits per number. The loop keeps track of the
+ * exponent instead of scaling, because below 2^-1022 the mantissa
+ * doesn't fit anymore and ldexp would round the bits that are shifted
+ * out. The number is in [x, x + 2^-1074) for the x we generate, so
+ * the bits have to be truncated, which is what the shift does. Once
+ * we're more than 1074 bits down nothing is left but 0.0.
+ *
+ * Whenever r0to1b doesn't return 0.0 this returns exactly the same
+ * number from the same bits.
+ */
+double
+r0to1full(void)
+{
+	union {
+		uint64_t u;
+		double d;
+	} res;
+	uint64_t r, m;
+	int e, shift;
+
+	for (shift = 0; shift < 1075; shift += 52) {
+		r = rX(53);
+		e = ffsll(r);
+		if (e == 0 || e > 52)
+			continue;
+		m = (r >> e) << (e - 1);
+		e += shift;
+		if (e < 1023) {
+			res.u = ((uint64_t)(1023 - e) << 52) | m;
+		} else if (e - 1022 < 53) {
+			/* Subnormal, shift the implicit bit in and truncate. */
+			res.u = ((1ULL << 52) | m) >> (e - 1022);
+		} else {
+			break;
+		}
+		return res.d;
+	}
+	return 0.0;
+}
+
+/*
+ * When generating lots of numbers at once, r0to1b_fill in r0to1.h
+ * does the same thing as r0to1b without the branches and the ldexp,
+ * and with SIMD when the CPU has it.
+ */
+
 /*
  * Tests that our assumptions hold.
  */
@@ -310,13 +365,121 @@ check_1to2(double (*fn)(void), struct r1_test *rt)
 	B(x, rt);
 }
 
+/*
+ * The bulk fill has to give us exactly the same numbers as r0to1b
+ * from the same bits. We can't rewind `arc4random_buf`, so run both
+ * from the same ChaCha key, with enough numbers to cross a few
+ * refills.
+ */
+static void
+check_fill_kernel(r0to1b_kernel kernel, const char *name)
+{
+	static double a[10007];
+	const uint32_t key[8] = { 0x52, 0x30, 0x74, 0x6f, 0x31, 0x62 };
+	struct rx_chacha c;
+	size_t n, i;
+
+	for (n = 1; n < 10007; n = n * 3 + 1) {
+		rx_chacha_init(&c, key, n, 8);
+		rX_source(rx_chacha_fill, &c);
+		rX(n % 64 + 1);		/* Don't always start at bit 0. */
+		r0to1b_fill_kernel(kernel, a, n);
+		rx_chacha_init(&c, key, n, 8);
+		rX_source(rx_chacha_fill, &c);
+		rX(n % 64 + 1);
+		for (i = 0; i < n; i++) {
+			double b = r0to1b();
+			if (memcmp(&a[i], &b, sizeof(b))) {
+				printf("fill(%s)[%zu]: %a, r0to1b: %a\n", name, i, a[i], b);
+				abort();
+			}
+		}
+	}
+}
+
+/*
+ * r0to1full needs to be checked at the bottom too, which random bits
+ * never reach. This source gives us a stream of zeroes with only bit
+ * number *arg set, so the result has to be 2^-(bit + 1) for every bit
+ * where r0to1b would have found a set bit, 0.0 below 2^-1074, and the
+ * top bit of every 53 bits just means that we go one level down.
+ */
+static void
+one_bit_fill(void *arg, uint64_t *buf, size_t n)
+{
+	int64_t *bit = arg;
+
+	memset(buf, 0, n * sizeof(*buf));
+	if (*bit >= 0 && *bit < (int64_t)(n * 64))
+		buf[*bit / 64] = 1ULL << (*bit % 64);
+	*bit -= n * 64;
+}
+
+static void
+check_full(void)
+{
+	const uint32_t key[8] = { 0x66756c6c };
+	struct rx_chacha c;
+	int64_t p, bit;
+	double a, b;
+	int i;
+
+	for (p = 0; p < 53 * 22; p++) {
+		int lvl = p / 53, o = p % 53;
+		int e = 52 * lvl + o + 1;
+
+		if (o == 52 || e > 1074)
+			b = 0.0;
+		else
+			b = ldexp(1.0, -e);
+		bit = p;
+		rX_source(one_bit_fill, &bit);
+		a = r0to1full();
+		if (a != b) {
+			printf("r0to1full(bit %" PRId64 "): %a, expected %a\n", p, a, b);
+			abort();
+		}
+	}
+
+	rx_chacha_init(&c, key, 0, 8);
+	rX_source(rx_chacha_fill, &c);
+	for (i = 0; i < 1000000; i++) {
+		a = r0to1full();
+		/* Rewind 53 bits, the reservoir is big enough to not have refilled. */
+		if (rx_res.pos < 53 || a < 0x1p-52)
+			continue;
+		rx_res.pos -= 53;
+		b = r0to1b();
+		if (memcmp(&a, &b, sizeof(a))) {
+			printf("r0to1full: %a, r0to1b: %a\n", a, b);
+			abort();
+		}
+	}
+	rX_source(rx_arc4random_fill, NULL);
+}
+
+static void
+check_fill(void)
+{
+	check_fill_kernel(r0to1b_kernel_scalar, "scalar");
+#if defined(__x86_64__) && defined(__GNUC__)
+	if (__builtin_cpu_supports("avx2"))
+		check_fill_kernel(r0to1b_kernel_avx2, "avx2");
+	if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512cd"))
+		check_fill_kernel(r0to1b_kernel_avx512, "avx512");
+#endif
+	rX_source(rx_arc4random_fill, NULL);
+}
+
 int
 main(int argc, char **argv)
 {
 	const uint64_t numruns = 1LL << 25;
 	struct r1_test r1a = { 0 };
 	struct r1_test r1b = { 0 };
-	uint64_t i;
+	struct r1_test r1c = { 0 };
+	double fill[1024];
+	uint64_t i, j;
 
 	for (i = 0; i < numruns / 10; i++) {
 		check_simple();
@@ -333,6 +496,17 @@ main(int argc, char **argv)
 		check_1to2(r0to1b, &r1b);
 	}
 
+	check_fill();
+	check_full();
+
+	for (i = 0; i < numruns; i += 1024) {
+		r0to1b_fill(fill, 1024);
+		for (j = 0; j < 1024; j++) {
+			A(fill[j], 0.0, 1.0);
+			B(fill[j], &r1c);
+		}
+	}
+
 	for (i = 1; i < 52; i++) {
 		uint64_t expected_bits = ((1LL << 52) - 1);
 		expected_bits ^= (1LL << i) - 1;
@@ -355,6 +529,12 @@ main(int argc, char **argv)
 			    i, r1b.m_bits_set[i], expected_bits,
 			    r1b.m_bits_set[i] ^ expected_bits);
 		}
+		if (r1c.m_bits_set[i] != expected_bits && r1c.efreq[i] > 25) {
+			printf("bits3[%" PRIu64 "]: 0x%" PRIx64 ", expected 0x%" PRIx64
+			    ", diff: 0x%" PRIx64 "\n",
+			    i, r1c.m_bits_set[i], expected_bits,
+			    r1c.m_bits_set[i] ^ expected_bits);
+		}
 	}
 
 	for (i = 0; i < 52; i++) {
@@ -374,5 +554,15 @@ main(int argc, char **argv)
 		    -i, r1b.efreq[i], expected, (double)r1b.efreq[i] / (double)expected,
 		    r1b.min[i], r1b.max[i]);
 	}
+
+	for (i = 0; i < 52; i++) {
+		if (r1c.efreq[i] == 0)
+			continue;
+		uint64_t expected = numruns / (1LLU << (i + 1));
+		printf("freq3[%" PRId64 "]: %" PRIu64 ", expected: %" PRIu64
+		    ", deviation %.2f, range %f - %f\n",
+		    -i, r1c.efreq[i], expected, (double)r1c.efreq[i] / (double)expected,
+		    r1c.min[i], r1c.max[i]);
+	}
 	return 0;
 }
@@ -0,0 +1,443 @@
+/*
+ * Copyright (c) 2015 Artur Grabowski <art@blahonga.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef RD_RANGE_H
+#define RD_RANGE_H
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <math.h>
+#include <assert.h>
+
+#include "rX.h"
+
+/*
+ * The step between the numbers and how many there are, counted in
+ * integers from the bits of the doubles. See numbers_between in
+ * arbitrary_range.c for why and how.
+ *
+ * The numbers are the multiples of step in [from, to), which are
+ * start, start + step, ..., start + (count - 1) * step, where start
+ * is from rounded up to a multiple of step.
+ */
+static inline uint64_t
+rd_range_count(double from, double to, double *stepp, double *startp)
+{
+	const uint64_t M = (1ULL << 52) - 1;
+	uint64_t f, t, n, mf, mt, ef, et, s, sh, first, step;
+
+	assert(from >= 0 && to > 0 && from < to && to < INFINITY);
+	memcpy(&f, &from, sizeof(f));
+	memcpy(&t, &to, sizeof(t));
+	f &= ~(1ULL << 63);		/* -0.0 */
+	n = t - 1;			/* nextafter(to, from) is at least as big as from */
+
+	/* Every positive double is m * 2^(e - 1075). */
+	ef = (f >> 52) + ((f >> 52) == 0);
+	et = (t >> 52) + ((t >> 52) == 0);
+	s = (n >> 52) + ((n >> 52) == 0);
+	mf = (f & M) | (uint64_t)((f >> 52) != 0) << 52;
+	mt = (t & M) | (uint64_t)((t >> 52) != 0) << 52;
+
+	/* from / step rounded up. Shifting out more than 53 bits is the same as 63. */
+	sh = s - ef < 63 ? s - ef : 63;
+	first = (mf >> sh) + ((mf & ((1ULL << sh) - 1)) != 0);
+
+	step = s > 52 ? (s - 52) << 52 : 1ULL << (s - 1);
+	memcpy(stepp, &step, sizeof(step));
+	*startp = (double)first * *stepp;
+	return (mt << (et - s)) - first;
+}
+
+/*
+ * A random number in [0, upper_bound) without modulo bias, Lemire's
+ * multiplication with a rejection. See arbitrary_range.c for how and
+ * why it works.
+ */
+static inline uint64_t
+r_uniform(uint64_t upper_bound)
+{
+	unsigned __int128 m;
+	uint64_t l, min;
+
+	if (upper_bound < 2)
+		return 0;
+	if ((upper_bound & (upper_bound - 1)) == 0)
+		return rX(__builtin_ctzll(upper_bound));
+
+	m = (unsigned __int128)rX(64) * upper_bound;
+	l = (uint64_t)m;
+	if (l < upper_bound) {
+		/* 2**64 % x == (2**64 - x) % x */
+		min = -upper_bound % upper_bound;
+		while (l < min) {
+			RX_STAT_ADD(rejections, 1);
+			m = (unsigned __int128)rX(64) * upper_bound;
+			l = (uint64_t)m;
+		}
+	}
+
+	return m >> 64;
+}
+
+/*
+ * A random double in [from, to) for 0 <= from < to, see
+ * arbitrary_range.c for how the numbers are picked.
+ */
+static inline double
+rd_positive(double from, double to)
+{
+	double step, start;
+	uint64_t count = rd_range_count(from, to, &step, &start);
+
+	return start + (double)(r_uniform(count)) * step;
+}
+
+/*
+ * rd_positive counts for every number, and r_uniform might do a
+ * division for the threshold. But when we generate lots of numbers
+ * it's almost always from the same range, so all of that can be done
+ * once up front, like the param_type of a C++ distribution.
+ */
+struct rd_range {
+	double from;		/* from rounded up to a multiple of step. */
+	double step;
+	uint64_t count;
+	uint64_t min;		/* 2**64 % count, see r_uniform. */
+	int bits;		/* count == 2^bits, 0 if it isn't a power of two. */
+};
+
+static inline void
+rd_range_init(struct rd_range *rr, double from, double to)
+{
+	rr->count = rd_range_count(from, to, &rr->step, &rr->from);
+	/* count is at least 1 and for 1 this is 0, which never rejects. */
+	rr->min = -rr->count % rr->count;
+	rr->bits = rr->count > 1 && (rr->count & (rr->count - 1)) == 0 ?
+	    __builtin_ctzll(rr->count) : 0;
+}
+
+/*
+ * r_uniform with the threshold already known. This consumes exactly
+ * the same random numbers as r_uniform does for the same bound, except
+ * for powers of two, which r_uniform takes straight from rX(). Callers
+ * that know they have a power of two (rr->bits) do that themselves.
+ */
+static inline uint64_t
+r_uniform_min(uint64_t upper_bound, uint64_t min)
+{
+	unsigned __int128 m;
+
+	m = (unsigned __int128)rX(64) * upper_bound;
+	while ((uint64_t)m < min) {
+		RX_STAT_ADD(rejections, 1);
+		m = (unsigned __int128)rX(64) * upper_bound;
+	}
+
+	return m >> 64;
+}
+
+/*
+ * Lots of numbers with the same bound. r_uniform_min does one number
+ * at a time and rX(64) for every random number, with a branch on the
+ * rejection that the CPU can't predict for bounds where it matters.
+ *
+ * Instead take the random words straight out of the rX() buffer and
+ * for each of them always store the result and only advance the
+ * output when it isn't rejected. A rejected number gets overwritten
+ * by the next one. That's exactly what the loop in r_uniform_min
+ * does, so the results are the same as calling it n times with the
+ * same random bits, just without the branches.
+ *
+ * With AVX-512 the same is done eight words at a time. There is no
+ * 64x64->128 bit multiplication in vector registers, so it's put
+ * together from four 32x32->64 bit ones, and the numbers that aren't
+ * rejected are packed into the output with a compress store. That
+ * only works while at least eight more numbers are wanted, otherwise
+ * it could use random words that r_uniform_min wouldn't have, the
+ * rest is done by the scalar loop.
+ *
+ * The kernels use at most k words starting at bit `pos` of `buf` and
+ * return how many numbers they generated, *usedp is how many words
+ * they consumed.
+ */
+typedef size_t (*r_uniform_kernel)(uint64_t *, size_t, uint64_t, uint64_t,
+    const uint64_t *, uint64_t, size_t, size_t *);
+
+/*
+ * The power of two version: n times rX(bits), without the loop.
+ */
+static inline void
+r_uniform_fill_bits(int bits, uint64_t *out, size_t n)
+{
+	const uint64_t mask = bits == 64 ? ~0ULL : (1ULL << bits) - 1;
+
+	while (n) {
+		size_t k = (RX_BITS - rx_res.pos) / bits, i;
+		const uint64_t *b = rx_res.buf;
+		uint64_t pos = rx_res.pos;
+
+		if (k == 0) {
+			*out++ = rX(bits);
+			n--;
+			continue;
+		}
+		if (k > n)
+			k = n;
+		for (i = 0; i < k; i++, pos += bits) {
+			uint64_t w = pos >> 6, off = pos & 63;
+			uint64_t r = off ? (b[w] >> off) | (b[w + 1] << (64 - off)) : b[w];
+
+			out[i] = r & mask;
+		}
+		rx_res.pos = pos;
+		out += k;
+		n -= k;
+	}
+}
+
+static inline size_t
+r_uniform_kernel_scalar(uint64_t *out, size_t n, uint64_t upper_bound, uint64_t min,
+    const uint64_t *buf, uint64_t pos, size_t k, size_t *usedp)
+{
+	const uint64_t *b = buf + (pos >> 6);
+	unsigned off = pos & 63;
+	size_t i, j;
+
+	for (i = 0, j = 0; i < k && j < n; i++) {
+		uint64_t r = off ? (b[i] >> off) | (b[i + 1] << (64 - off)) : b[i];
+		unsigned __int128 m = (unsigned __int128)r * upper_bound;
+
+		out[j] = m >> 64;
+		j += (uint64_t)m >= min;
+	}
+	*usedp = i;
+	return j;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+
+__attribute__((target("avx512f")))
+static inline size_t
+r_uniform_kernel_avx512(uint64_t *out, size_t n, uint64_t upper_bound, uint64_t min,
+    const uint64_t *buf, uint64_t pos, size_t k, size_t *usedp)
+{
+	const uint64_t *b = buf + (pos >> 6);
+	const __m128i sr = _mm_cvtsi32_si128(pos & 63);
+	const __m128i sl = _mm_cvtsi32_si128(64 - (pos & 63));	/* 64 shifts in zeroes. */
+	const __m512i lo32 = _mm512_set1_epi64(0xffffffff);
+	const __m512i ubl = _mm512_set1_epi64(upper_bound & 0xffffffff);
+	const __m512i ubh = _mm512_set1_epi64(upper_bound >> 32);
+	const __m512i vmin = _mm512_set1_epi64(min);
+	size_t i, j, used;
+
+	for (i = 0, j = 0; i + 8 <= k && n - j >= 8; i += 8) {
+		__m512i r, rh, ll, lh, hl, hh, mid, hi, lo;
+		__mmask8 ok;
+
+		r = _mm512_or_si512(_mm512_srl_epi64(_mm512_loadu_si512(b + i), sr),
+		    _mm512_sll_epi64(_mm512_loadu_si512(b + i + 1), sl));
+		rh = _mm512_srli_epi64(r, 32);
+		ll = _mm512_mul_epu32(r, ubl);
+		lh = _mm512_mul_epu32(r, ubh);
+		hl = _mm512_mul_epu32(rh, ubl);
+		hh = _mm512_mul_epu32(rh, ubh);
+		/* At most 3 * (2^32 - 1), no overflow. */
+		mid = _mm512_add_epi64(_mm512_srli_epi64(ll, 32), _mm512_add_epi64(
+		    _mm512_and_si512(lh, lo32), _mm512_and_si512(hl, lo32)));
+		hi = _mm512_add_epi64(_mm512_add_epi64(hh, _mm512_srli_epi64(mid, 32)),
+		    _mm512_add_epi64(_mm512_srli_epi64(lh, 32), _mm512_srli_epi64(hl, 32)));
+		lo = _mm512_or_si512(_mm512_slli_epi64(mid, 32), _mm512_and_si512(ll, lo32));
+		ok = _mm512_cmpge_epu64_mask(lo, vmin);
+		_mm512_mask_compressstoreu_epi64(out + j, ok, hi);
+		j += __builtin_popcount(ok);
+	}
+	j += r_uniform_kernel_scalar(out + j, n - j, upper_bound, min, buf,
+	    pos + i * 64, k - i, &used);
+	*usedp = i + used;
+	return j;
+}
+#endif
+
+static inline void
+r_uniform_fill_kernel(r_uniform_kernel kernel, uint64_t upper_bound, uint64_t min,
+    uint64_t *out, size_t n)
+{
+	while (n) {
+		size_t k = (RX_BITS - rx_res.pos) / 64, used, got;
+
+		if (k == 0) {
+			/* The next word straddles a refill. */
+			*out++ = r_uniform_min(upper_bound, min);
+			n--;
+			continue;
+		}
+		got = kernel(out, n, upper_bound, min, rx_res.buf, rx_res.pos, k, &used);
+		rx_res.pos += used * 64;
+		RX_STAT_ADD(rejections, used - got);
+		out += got;
+		n -= got;
+	}
+}
+
+static inline r_uniform_kernel
+r_uniform_best_kernel(void)
+{
+#if defined(__x86_64__) && defined(__GNUC__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f"))
+		return r_uniform_kernel_avx512;
+#endif
+	return r_uniform_kernel_scalar;
+}
+
+static inline void
+r_uniform_fill_min(uint64_t upper_bound, uint64_t min, uint64_t *out, size_t n)
+{
+	static r_uniform_kernel best;
+	r_uniform_kernel kernel = __atomic_load_n(&best, __ATOMIC_RELAXED);
+
+	if (upper_bound > 1 && (upper_bound & (upper_bound - 1)) == 0) {
+		r_uniform_fill_bits(__builtin_ctzll(upper_bound), out, n);
+		return;
+	}
+	if (kernel == NULL) {
+		kernel = r_uniform_best_kernel();
+		__atomic_store_n(&best, kernel, __ATOMIC_RELAXED);
+	}
+	r_uniform_fill_kernel(kernel, upper_bound, min, out, n);
+}
+
+/*
+ * n numbers from r_uniform(upper_bound), with one division for all of
+ * them. Like r_uniform, bounds below 2 don't consume any random bits.
+ */
+static inline void
+r_uniform_fill(uint64_t upper_bound, uint64_t *out, size_t n)
+{
+	if (upper_bound < 2) {
+		memset(out, 0, n * sizeof(*out));
+		return;
+	}
+	r_uniform_fill_min(upper_bound, -upper_bound % upper_bound, out, n);
+}
+
+/*
+ * The step is a power of two and the random number is less than 2^53
+ * so the multiplication is exact, and since from is a multiple of the
+ * step the sum is a multiple of the step less than to, which is
+ * exactly representable. Nothing is rounded, so a compiler that fuses
+ * this into an fma gets the same result.
+ */
+static inline double
+rd_range_draw(const struct rd_range *rr)
+{
+	uint64_t k = rr->bits ? rX(rr->bits) : r_uniform_min(rr->count, rr->min);
+
+	return rr->from + (double)k * rr->step;
+}
+
+/*
+ * The same numbers as calling rd_range_draw n times.
+ */
+static inline void
+rd_range_fill(const struct rd_range *rr, double *out, size_t n)
+{
+	uint64_t k[512];
+	size_t i, j, len;
+
+	for (i = 0; i < n; i += len) {
+		len = n - i < 512 ? n - i : 512;
+		r_uniform_fill_min(rr->count, rr->min, k, len);
+		for (j = 0; j < len; j++)
+			out[i + j] = rr->from + (double)k[j] * rr->step;
+	}
+}
+
+/*
+ * k different numbers from the range. Drawing numbers and throwing
+ * away the ones we've already seen gets slower and slower as k gets
+ * close to the count, but the numbers in the range are just the
+ * numbers [0, count) in disguise, so this is the classic problem of
+ * picking k different integers, and Robert Floyd solved that with
+ * exactly k random numbers:
+ *
+ *	for j in count - k .. count - 1:
+ *		t = r_uniform(j + 1)
+ *		pick t, or j if t was already picked
+ *
+ * Every k-subset comes out with the same probability. The picked
+ * numbers are kept in an open addressing hash table twice the size
+ * of k, so the memory and the time are O(k) no matter how big the
+ * range is. The numbers are stored in out in the order they were
+ * picked, which is not a random order (count - 1 tends to come
+ * late), so either sort them or shuffle them if the order matters.
+ * With `sorted` they are sorted.
+ *
+ * Returns -1 if there aren't k numbers in the range.
+ */
+static inline int
+rd_range_sample_cmp(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+static inline int
+rd_range_sample(const struct rd_range *rr, double *out, size_t k, int sorted)
+{
+	const uint64_t empty = UINT64_MAX;	/* count is never that big. */
+	uint64_t *set, mask, j, t, h;
+	size_t size, i;
+	int shift;
+
+	if (k > rr->count)
+		return -1;
+	if (k == 0)
+		return 0;
+	for (size = 2, shift = 63; size < 2 * k; size *= 2, shift--)
+		;
+	mask = size - 1;
+	if ((set = (uint64_t *)malloc(size * sizeof(*set))) == NULL)
+		abort();
+	memset(set, 0xff, size * sizeof(*set));
+
+	for (i = 0, j = rr->count - k; j < rr->count; j++, i++) {
+		t = r_uniform(j + 1);
+		for (h = (t * 0x9E3779B97F4A7C15ULL) >> shift; set[h] != empty; h = (h + 1) & mask)
+			if (set[h] == t)
+				break;
+		if (set[h] == t) {
+			/* j has never been picked, j is bigger than anything before. */
+			t = j;
+			for (h = (t * 0x9E3779B97F4A7C15ULL) >> shift; set[h] != empty;
+			    h = (h + 1) & mask)
+				;
+		}
+		set[h] = t;
+		out[i] = rr->from + (double)t * rr->step;
+	}
+	free(set);
+	if (sorted)
+		qsort(out, k, sizeof(*out), rd_range_sample_cmp);
+	return 0;
+}
+
+#endif /* RD_RANGE_H */
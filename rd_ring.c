@@ -0,0 +1,189 @@
+/*
+ * Copyright (c) 2015 Artur Grabowski <art@blahonga.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef RD_RING_LATENCY
+#define RD_RING_LATENCY
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <assert.h>
+#include <unistd.h>
+
+#include "rX.h"
+#include "rX_sources.h"
+#include "r0to1.h"
+#include "rd_range.h"
+#include "rd_ring.h"
+
+/*
+ * Check that the ring hands out exactly the numbers the fill function
+ * makes, and compare how long a number takes from the ring and from
+ * calling the generators directly. Compile with -pthread.
+ */
+
+static void
+fill_r0to1b(void *arg, double *out, size_t n)
+{
+	(void)arg;
+	r0to1b_fill(out, n);
+}
+
+static void
+fill_range(void *arg, double *out, size_t n)
+{
+	rd_range_fill(arg, out, n);
+}
+
+/*
+ * Same bits in the producer as in the reference fill, so the same
+ * numbers in the same order, no matter how the two threads happen to
+ * run. The consumer sleeps now and then so that the ring gets full
+ * and the producer has to be woken up, and then drains it so that it
+ * gets empty and the consumer has to wait.
+ */
+static void
+test_same(const char *name, rd_ring_fn fn, void *arg)
+{
+	const uint32_t key[8] = { 0x72, 0x69, 0x6e, 0x67 };
+	const size_t size = 4 * RD_RING_BATCH, n = 100 * size + 123;
+	double *ref = malloc(n * sizeof(*ref));
+	struct rx_chacha c, pc;
+	struct rd_ring r;
+	size_t i;
+
+	assert(ref != NULL);
+	rx_chacha_init(&c, key, 0, 8);
+	rX_source(rx_chacha_fill, &c);
+	fn(arg, ref, n);
+	rX_source(rx_arc4random_fill, NULL);
+
+	rx_chacha_init(&pc, key, 0, 8);
+	rd_ring_start(&r, size, fn, arg, rx_chacha_fill, &pc);
+	for (i = 0; i < n; i++) {
+		double d = rd_ring_pop(&r);
+
+		if (memcmp(&d, &ref[i], sizeof(d))) {
+			printf("%s[%zu]: %a from the ring, %a from the fill\n",
+			    name, i, d, ref[i]);
+			abort();
+		}
+		if (i % 10007 == 0)
+			usleep(1000);
+	}
+	rd_ring_stop(&r);
+	free(ref);
+}
+
+#define LAT_N (1 << 21)
+#define WORK_NS 200
+
+static void
+report(const char *name, const struct rd_ring_lat *l)
+{
+	printf("%-26s p50 %6.1f ns p99 %6.1f ns p999 %8.1f ns max %10.1f ns\n", name,
+	    rd_ring_lat_ns(l, 0.5), rd_ring_lat_ns(l, 0.99),
+	    rd_ring_lat_ns(l, 0.999), rd_ring_lat_ns(l, 1.0));
+}
+
+/*
+ * Pretend to do something useful between the numbers, the consumer
+ * the ring is for doesn't want random numbers as fast as it can get
+ * them.
+ */
+static void
+work(uint64_t ticks)
+{
+	uint64_t t0 = rd_ring_ticks();
+
+	while (rd_ring_ticks() - t0 < ticks)
+		;
+}
+
+/*
+ * Every number is timed the same way: the ticks before and after, so
+ * the time includes reading the clock. The direct calls get their bits
+ * from `arc4random_buf`, like the ring's producer, since the refills
+ * are the point.
+ */
+#define LATENCY(l, expr) do {						\
+	int i;								\
+	memset(&(l), 0, sizeof(l));					\
+	for (i = 0; i < LAT_N; i++) {					\
+		uint64_t t0 = rd_ring_ticks();				\
+		sink += (expr);						\
+		rd_ring_lat_add(&(l), rd_ring_ticks() - t0);		\
+		work(wticks);						\
+	}								\
+} while (0)
+
+static double sink;
+
+static void
+latency(void)
+{
+	const uint64_t wticks = WORK_NS / rd_ring_tick_ns();
+	struct rd_ring_lat l;
+	struct rd_range rr;
+	struct rd_ring r;
+	int i;
+
+	rd_range_init(&rr, 0.1, 0.7);
+	printf("%ld cpus, %d ns of work between the numbers\n",
+	    sysconf(_SC_NPROCESSORS_ONLN), WORK_NS);
+
+	LATENCY(l, r0to1b_bits(rX(53)));
+	report("r0to1b", &l);
+	LATENCY(l, rd_range_draw(&rr));
+	report("rd_range_draw", &l);
+
+	rd_ring_start(&r, 1 << 16, fill_r0to1b, NULL, NULL, NULL);
+	usleep(10000);
+	for (i = 0; i < LAT_N; i++) {
+		sink += rd_ring_pop(&r);
+		work(wticks);
+	}
+	report("rd_ring_pop r0to1b", &r.lat);
+	rd_ring_stop(&r);
+
+	rd_ring_start(&r, 1 << 16, fill_range, &rr, NULL, NULL);
+	usleep(10000);
+	for (i = 0; i < LAT_N; i++) {
+		sink += rd_ring_pop(&r);
+		work(wticks);
+	}
+	report("rd_ring_pop rd_range", &r.lat);
+	rd_ring_stop(&r);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct rd_range rr;
+
+	test_same("r0to1b", fill_r0to1b, NULL);
+	rd_range_init(&rr, 0.1, 0.7);
+	test_same("rd_range", fill_range, &rr);
+	rd_range_init(&rr, 0x1p52, 0x1p52 + 3);
+	test_same("rd_range 3", fill_range, &rr);
+
+	latency();
+	if (sink == 42)
+		printf("\n");
+	return 0;
+}
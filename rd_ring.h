@@ -0,0 +1,358 @@
+/*
+ * Copyright (c) 2015 Artur Grabowski <art@blahonga.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef RD_RING_H
+#define RD_RING_H
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <assert.h>
+#include <pthread.h>
+
+#include "rX.h"
+
+/*
+ * A number from r0to1b() usually costs a few nanoseconds, but every
+ * 4KiB of random bits the rX() buffer is refilled, which with
+ * `arc4random_buf` sometimes means a reseed, and r_uniform can reject
+ * and go around again. For code that wants a number right now, every
+ * time, a thread can generate the numbers ahead of time into a ring
+ * and the code just takes the next one out of it.
+ *
+ * The ring has one producer, the thread started by rd_ring_start, and
+ * one consumer, whoever calls rd_ring_pop. The producer generates
+ * RD_RING_BATCH numbers at a time with `fn`, which is called like the
+ * fill function of parallel_fill.h (r0to1b_fill or rd_range_fill with
+ * the range in `arg`), straight into the ring, and then publishes them
+ * by moving `head`. The consumer takes a number and moves `tail`. No
+ * locks, and a fence only once per batch: head is only written by the
+ * producer and tail only by the consumer, each on its own cache line,
+ * and each side keeps a copy of the other side's counter and only
+ * reads the real one (and pulls over its cache line) when the copy
+ * says the ring is full or empty.
+ *
+ * When the ring is full the producer sleeps on a condition variable,
+ * and the consumer checks if it should wake it up once every batch.
+ * When the ring is empty the consumer spins for a while and then
+ * sleeps until the producer has published a batch. That's the slow
+ * path, a consumer that takes numbers faster than one core can make
+ * them will end up there all the time and would be better off calling
+ * r0to1b_fill itself.
+ *
+ * The producer thread has its own rX() buffer (it's per thread), so
+ * it needs its own source of bits, `src` and `src_arg` are passed to
+ * rX_source in the thread. With src == NULL it's `arc4random_buf`.
+ *
+ * Compiled with -DRD_RING_LATENCY every rd_ring_pop is timed and
+ * counted in a histogram, and rd_ring_latency tells how long a given
+ * fraction of the pops took. Compile with -pthread.
+ */
+
+#define RD_RING_BATCH 512
+#define RD_RING_SPIN 128
+
+typedef void (*rd_ring_fn)(void *arg, double *out, size_t n);
+
+#ifdef RD_RING_LATENCY
+#include <math.h>
+#include <time.h>
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <x86intrin.h>
+#endif
+
+/*
+ * Time in ticks, which are cycles of the TSC where there is one and
+ * nanoseconds everywhere else.
+ *
+ * The histogram counts ticks exactly up to 64 and then with 32
+ * buckets between every power of two and the next, so every time is
+ * within 3% of the real one and the whole thing is 15KiB.
+ */
+#define RD_RING_LAT_BUCKETS (64 + 58 * 32)
+
+struct rd_ring_lat {
+	uint64_t n;
+	uint64_t count[RD_RING_LAT_BUCKETS];
+};
+
+static inline uint64_t
+rd_ring_ticks(void)
+{
+#if defined(__x86_64__) && defined(__GNUC__)
+	return __rdtsc();
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+static inline void
+rd_ring_lat_add(struct rd_ring_lat *l, uint64_t t)
+{
+	int e;
+
+	if (t < 64) {
+		l->count[t]++;
+	} else {
+		e = 63 - __builtin_clzll(t);
+		l->count[64 + (e - 6) * 32 + ((t >> (e - 5)) & 31)]++;
+	}
+	l->n++;
+}
+
+/*
+ * Nanoseconds per tick, measured against the clock over 20ms the
+ * first time it's needed.
+ */
+static inline double
+rd_ring_tick_ns(void)
+{
+	static double ns;
+#if defined(__x86_64__) && defined(__GNUC__)
+	struct timespec a, b;
+	uint64_t ta, tb;
+
+	if (ns == 0) {
+		clock_gettime(CLOCK_MONOTONIC, &a);
+		ta = rd_ring_ticks();
+		do {
+			clock_gettime(CLOCK_MONOTONIC, &b);
+		} while ((b.tv_sec - a.tv_sec) * 1e9 + (b.tv_nsec - a.tv_nsec) < 2e7);
+		tb = rd_ring_ticks();
+		ns = ((b.tv_sec - a.tv_sec) * 1e9 + (b.tv_nsec - a.tv_nsec)) / (tb - ta);
+	}
+#else
+	ns = 1.0;
+#endif
+	return ns;
+}
+
+/*
+ * The time in nanoseconds that a fraction q of the samples took at
+ * most, rounded down to the bucket. q = 1 is the slowest one.
+ */
+static inline double
+rd_ring_lat_ns(const struct rd_ring_lat *l, double q)
+{
+	uint64_t want = ceil(q * l->n), sum = 0, t;
+	int b, e;
+
+	if (want == 0)
+		want = 1;
+	for (b = 0; b < RD_RING_LAT_BUCKETS - 1; b++) {
+		sum += l->count[b];
+		if (sum >= want)
+			break;
+	}
+	if (b < 64) {
+		t = b;
+	} else {
+		e = (b - 64) / 32 + 6;
+		t = (uint64_t)(32 + (b - 64) % 32) << (e - 5);
+	}
+	return t * rd_ring_tick_ns();
+}
+#endif
+
+struct rd_ring {
+	/* Written by the producer. */
+	uint64_t head __attribute__((aligned(64)));
+	uint64_t tail_seen;		/* The last tail the producer read. */
+	int prod_waiting;
+
+	/* Written by the consumer. */
+	uint64_t tail __attribute__((aligned(64)));
+	uint64_t head_seen;		/* The last head the consumer read. */
+	int cons_waiting;
+#ifdef RD_RING_LATENCY
+	struct rd_ring_lat lat;
+#endif
+
+	/* Set up by rd_ring_start. */
+	double *buf __attribute__((aligned(64)));
+	uint64_t mask;
+	rd_ring_fn fn;
+	void *arg;
+	void (*src)(void *, uint64_t *, size_t);
+	void *src_arg;
+	int stop;
+	pthread_mutex_t mtx;
+	pthread_cond_t data, space;
+	pthread_t thr;
+};
+
+static inline void *
+rd_ring_thread(void *v)
+{
+	struct rd_ring *r = v;
+	uint64_t size = r->mask + 1, head = r->head;
+
+	if (r->src != NULL)
+		rX_source(r->src, r->src_arg);
+	while (!__atomic_load_n(&r->stop, __ATOMIC_RELAXED)) {
+		if (head - r->tail_seen > size - RD_RING_BATCH) {
+			r->tail_seen = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+			if (head - r->tail_seen > size - RD_RING_BATCH) {
+				/*
+				 * Full. The consumer looks at prod_waiting
+				 * after it has moved tail past a batch, and
+				 * we look at tail after setting it, so one of
+				 * us sees the other.
+				 */
+				pthread_mutex_lock(&r->mtx);
+				__atomic_store_n(&r->prod_waiting, 1, __ATOMIC_SEQ_CST);
+				while (!r->stop && head - (r->tail_seen =
+				    __atomic_load_n(&r->tail, __ATOMIC_SEQ_CST)) > size - RD_RING_BATCH)
+					pthread_cond_wait(&r->space, &r->mtx);
+				__atomic_store_n(&r->prod_waiting, 0, __ATOMIC_RELAXED);
+				pthread_mutex_unlock(&r->mtx);
+				continue;
+			}
+		}
+		/* head is a multiple of the batch, so it never wraps in the middle. */
+		r->fn(r->arg, r->buf + (head & r->mask), RD_RING_BATCH);
+		head += RD_RING_BATCH;
+		__atomic_store_n(&r->head, head, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&r->cons_waiting, __ATOMIC_SEQ_CST)) {
+			pthread_mutex_lock(&r->mtx);
+			pthread_cond_signal(&r->data);
+			pthread_mutex_unlock(&r->mtx);
+		}
+	}
+	return NULL;
+}
+
+/*
+ * size is the number of doubles in the ring, a power of two and at
+ * least two batches.
+ */
+static inline void
+rd_ring_start(struct rd_ring *r, size_t size, rd_ring_fn fn, void *arg,
+    void (*src)(void *, uint64_t *, size_t), void *src_arg)
+{
+	assert(size >= 2 * RD_RING_BATCH && (size & (size - 1)) == 0);
+	r->head = r->tail_seen = r->tail = r->head_seen = 0;
+	r->prod_waiting = r->cons_waiting = r->stop = 0;
+#ifdef RD_RING_LATENCY
+	memset(&r->lat, 0, sizeof(r->lat));
+#endif
+	if ((r->buf = aligned_alloc(64, size * sizeof(*r->buf))) == NULL)
+		abort();
+	r->mask = size - 1;
+	r->fn = fn;
+	r->arg = arg;
+	r->src = src;
+	r->src_arg = src_arg;
+	pthread_mutex_init(&r->mtx, NULL);
+	pthread_cond_init(&r->data, NULL);
+	pthread_cond_init(&r->space, NULL);
+	if (pthread_create(&r->thr, NULL, rd_ring_thread, r))
+		abort();
+}
+
+static inline void
+rd_ring_stop(struct rd_ring *r)
+{
+	pthread_mutex_lock(&r->mtx);
+	__atomic_store_n(&r->stop, 1, __ATOMIC_RELAXED);
+	pthread_cond_broadcast(&r->space);
+	pthread_cond_broadcast(&r->data);
+	pthread_mutex_unlock(&r->mtx);
+	pthread_join(r->thr, NULL);
+	pthread_mutex_destroy(&r->mtx);
+	pthread_cond_destroy(&r->data);
+	pthread_cond_destroy(&r->space);
+	free(r->buf);
+	r->buf = NULL;
+}
+
+/*
+ * The ring is empty. Spin for a bit in case the producer is just about
+ * to publish a batch, and then sleep. Same dance as when the producer
+ * finds the ring full.
+ */
+static inline void
+rd_ring_wait(struct rd_ring *r)
+{
+	uint64_t tail = r->tail;
+	int i;
+
+	for (i = 0; i < RD_RING_SPIN; i++) {
+#if defined(__x86_64__) && defined(__GNUC__)
+		__builtin_ia32_pause();
+#endif
+		if ((r->head_seen = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE)) != tail)
+			return;
+	}
+	pthread_mutex_lock(&r->mtx);
+	__atomic_store_n(&r->cons_waiting, 1, __ATOMIC_SEQ_CST);
+	while ((r->head_seen = __atomic_load_n(&r->head, __ATOMIC_SEQ_CST)) == tail) {
+		assert(!r->stop);
+		pthread_cond_wait(&r->data, &r->mtx);
+	}
+	__atomic_store_n(&r->cons_waiting, 0, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&r->mtx);
+}
+
+static inline void
+rd_ring_wake(struct rd_ring *r)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&r->prod_waiting, __ATOMIC_RELAXED)) {
+		pthread_mutex_lock(&r->mtx);
+		pthread_cond_signal(&r->space);
+		pthread_mutex_unlock(&r->mtx);
+	}
+}
+
+static inline double
+rd_ring_pop(struct rd_ring *r)
+{
+	uint64_t tail = r->tail;
+	double d;
+#ifdef RD_RING_LATENCY
+	uint64_t t0 = rd_ring_ticks();
+#endif
+
+	if (tail == r->head_seen) {
+		r->head_seen = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		if (tail == r->head_seen)
+			rd_ring_wait(r);
+	}
+	d = r->buf[tail & r->mask];
+	__atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+	/* Only a whole free batch can wake up the producer. */
+	if (((tail + 1) & (RD_RING_BATCH - 1)) == 0)
+		rd_ring_wake(r);
+#ifdef RD_RING_LATENCY
+	rd_ring_lat_add(&r->lat, rd_ring_ticks() - t0);
+#endif
+	return d;
+}
+
+#ifdef RD_RING_LATENCY
+static inline double
+rd_ring_latency(const struct rd_ring *r, double q)
+{
+	return rd_ring_lat_ns(&r->lat, q);
+}
+#endif
+
+#endif /* RD_RING_H */
@@ -0,0 +1,312 @@
+/*
+ * Copyright (c) 2015 Artur Grabowski <art@blahonga.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <math.h>
+#include <assert.h>
+
+#include "rX.h"
+#include "rX_sources.h"
+#include "r0to1.h"
+
+/*
+ * Everything in rd.c and arbitrary_range.c, but for float.
+ *
+ * The obvious way to get a random float is to generate a double and
+ * convert it. That uses 53 random bits for a number that only has 24
+ * bits of precision, and worse, the conversion rounds, so a double
+ * just below 1.0 becomes 1.0f:
+ */
+static void
+test_narrowing(void)
+{
+	assert((float)nextafter(1.0, 0.0) == 1.0f);
+}
+
+/*
+ * r0to1bf is in r0to1.h next to the bulk version of r0to1b. It's the
+ * same algorithm as r0to1b with 24 bits instead of 53 (and without
+ * the 0.0 special case for the top bit, see the comment there).
+ */
+
+/*
+ * The prepared range from arbitrary_range.c. A float has 24 bits of
+ * precision so the count is at most 2^24 and we can do the bounded
+ * random number with a 32 bit random number and a 32x32->64 bit
+ * multiplication, so every number consumes 32 bits and not 64.
+ */
+struct rdf_range {
+	float from;
+	float step;
+	uint32_t count;
+	uint32_t min;		/* 2**32 % count, see r_uniform. */
+};
+
+static void
+rdf_range_init(struct rdf_range *rr, float from, float to)
+{
+	assert(from >= 0 && to > 0 && from < to);	/* positive numbers for now. */
+	float nxt = nextafterf(to, from);
+	float step = to - nxt;
+	/*
+	 * The multiples of step in [from, to), see numbers_between in
+	 * arbitrary_range.c. Every float divided by a power of two is
+	 * exact in double, so this is just the integer math done in
+	 * double.
+	 */
+	double first = ceil((double)from / step);
+	double count = (double)to / step - first;
+
+	assert(count <= (1 << 24));
+	rr->from = first * step;
+	rr->step = step;
+	rr->count = count;
+	rr->min = -rr->count % rr->count;
+}
+
+static float
+rdf_range_draw(const struct rdf_range *rr)
+{
+	uint64_t m;
+
+	m = rX(32) * rr->count;
+	while ((uint32_t)m < rr->min) {
+		RX_STAT_ADD(rejections, 1);
+		m = rX(32) * rr->count;
+	}
+
+	return rr->from + (float)(uint32_t)(m >> 32) * rr->step;
+}
+
+static float
+rdf_positive(float from, float to)
+{
+	struct rdf_range rr;
+
+	rdf_range_init(&rr, from, to);
+	return rdf_range_draw(&rr);
+}
+
+static void
+test_ranges(void)
+{
+	struct rdf_range rr;
+
+	rdf_range_init(&rr, 0x1p23f, 0x1p23f + 3);
+	assert(rr.count == 3);
+	rdf_range_init(&rr, 0x1p26f, 0x1p26f + 25);
+	assert(rr.count == 3);
+	rdf_range_init(&rr, 0, 0x1p24f);
+	assert(rr.count == 1 << 24);
+	rdf_range_init(&rr, 0, 0x1p24f + 2);
+	assert(rr.count == (1 << 23) + 1);
+	/* Same as r0to1bf. */
+	rdf_range_init(&rr, 0, 1);
+	assert(rr.count == 1 << 24 && rr.step == 0x1p-24f);
+	/* from isn't a multiple of the step. */
+	rdf_range_init(&rr, 0x1.000002p-2f, 0.7f);
+	assert(rr.from == 0x1.000004p-2f && rr.step == 0x1p-24f);
+	rdf_range_init(&rr, 0x1p-149f, 0x1p100f);
+	assert(rr.from == 0x1p76f && rr.count == (1 << 24) - 1);
+}
+
+/*
+ * Just like test_rd_positive_n in arbitrary_range.c.
+ */
+static void
+test_rdf_positive_n(int buckets)
+{
+	int attempts = 10000000;
+	float from = 0x1p23f, to = from + buckets;
+	int bucket[buckets];
+	int i;
+
+	memset(bucket, 0, sizeof(bucket));
+
+	for (i = 0; i < attempts; i++) {
+		float r = rdf_positive(from, to);
+		unsigned int b = (int)(r - from);
+		if (r < from || r >= to) {
+			printf("BAD: %f\n", r);
+			abort();
+		}
+		bucket[b]++;
+	}
+	int minbucket = attempts, maxbucket = 0;
+	for (i = 0; i < buckets; i++) {
+		if (bucket[i] < minbucket)
+			minbucket = bucket[i];
+		if (bucket[i] > maxbucket)
+			maxbucket = bucket[i];
+	}
+	double diff = (double)maxbucket/(double)minbucket - 1.0;
+	if (diff > 0.05) {
+		printf("rdf_positive: very large diff (should be close to 0): %f (%d %d)\n", diff, maxbucket, minbucket);
+	}
+}
+
+/*
+ * B() from rd.c for floats: check the exponent and which bits of the
+ * mantissa are set.
+ */
+struct rf_test {
+	uint64_t efreq[24];
+	uint32_t m_bits_set[24];
+};
+
+static void
+Bf(float r, struct rf_test *rt)
+{
+	union {
+		uint32_t u;
+		float f;
+	} foo;
+	uint32_t m, expected_bits;
+	int e, o;
+
+	if (r == 0.0f)
+		return;
+	foo.f = r;
+	e = (int)((foo.u >> 23) & 0xff) - 127;
+	if (e > -1 || e < -24) {
+		printf("Bf(e): %d outside [-24,-1]\n", e);
+		abort();
+	}
+	o = -e - 1;
+	rt->efreq[o]++;
+	m = foo.u & ((1U << 23) - 1);
+	rt->m_bits_set[o] |= m;
+	expected_bits = ((1U << 23) - 1) ^ ((1U << o) - 1);
+	if (m & ~expected_bits) {
+		printf("Bf(m): unexpected bits set: 0x%x, expected 0x%x\n", m, expected_bits);
+		abort();
+	}
+	if (r < ldexpf(1.0f, e) || r >= ldexpf(1.0f, e + 1)) {
+		printf("Bf: %a outside [2^%d,2^%d)\n", r, e, e + 1);
+		abort();
+	}
+}
+
+static void
+check_bits(const char *name, struct rf_test *rt, uint64_t numruns)
+{
+	int i;
+
+	for (i = 0; i < 24; i++) {
+		uint32_t expected_bits = ((1U << 23) - 1) ^ ((1U << i) - 1);
+		uint64_t expected = numruns >> (i + 1);
+
+		/* Same reasoning for 25 as in rd.c. */
+		if (rt->m_bits_set[i] != expected_bits && rt->efreq[i] > 25) {
+			printf("%s bits[%d]: 0x%x, expected 0x%x\n", name, i,
+			    rt->m_bits_set[i], expected_bits);
+		}
+		if (expected > 1000 && fabs((double)rt->efreq[i] / expected - 1.0) > 0.1) {
+			printf("%s freq[%d]: %" PRIu64 ", expected: %" PRIu64 "\n", name,
+			    -i, rt->efreq[i], expected);
+		}
+	}
+}
+
+/*
+ * r0to1bf, rdf_range [0,1) and r0to1bf_fill should all generate the
+ * same set of numbers.
+ */
+static void
+test_0to1(void)
+{
+	const uint64_t numruns = 1LL << 25;
+	struct rf_test ra = { 0 }, rb = { 0 }, rc = { 0 };
+	struct rdf_range rr;
+	float fill[1024];
+	uint64_t i, j;
+
+	rdf_range_init(&rr, 0.0f, 1.0f);
+	for (i = 0; i < numruns; i++) {
+		float a = r0to1bf(), b = rdf_range_draw(&rr);
+		assert(a >= 0.0f && a < 1.0f && b >= 0.0f && b < 1.0f);
+		Bf(a, &ra);
+		Bf(b, &rb);
+	}
+	for (i = 0; i < numruns; i += 1024) {
+		r0to1bf_fill(fill, 1024);
+		for (j = 0; j < 1024; j++) {
+			assert(fill[j] >= 0.0f && fill[j] < 1.0f);
+			Bf(fill[j], &rc);
+		}
+	}
+	check_bits("r0to1bf", &ra, numruns);
+	check_bits("rdf_range", &rb, numruns);
+	check_bits("r0to1bf_fill", &rc, numruns);
+}
+
+/*
+ * Same as check_fill in rd.c.
+ */
+static void
+check_fill_kernel(r0to1bf_kernel kernel, const char *name)
+{
+	static float a[10007];
+	const uint32_t key[8] = { 0x52, 0x30, 0x74, 0x6f, 0x31, 0x66 };
+	struct rx_chacha c;
+	size_t n, i;
+
+	for (n = 1; n < 10007; n = n * 3 + 1) {
+		rx_chacha_init(&c, key, n, 8);
+		rX_source(rx_chacha_fill, &c);
+		rX(n % 64 + 1);
+		r0to1bf_fill_kernel(kernel, a, n);
+		rx_chacha_init(&c, key, n, 8);
+		rX_source(rx_chacha_fill, &c);
+		rX(n % 64 + 1);
+		for (i = 0; i < n; i++) {
+			float b = r0to1bf();
+			if (memcmp(&a[i], &b, sizeof(b))) {
+				printf("fill(%s)[%zu]: %a, r0to1bf: %a\n", name, i, a[i], b);
+				abort();
+			}
+		}
+	}
+	rX_source(rx_arc4random_fill, NULL);
+}
+
+static void
+check_fill(void)
+{
+	check_fill_kernel(r0to1bf_kernel_scalar, "scalar");
+#if defined(__x86_64__) && defined(__GNUC__)
+	if (__builtin_cpu_supports("avx2"))
+		check_fill_kernel(r0to1bf_kernel_avx2, "avx2");
+	if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512cd"))
+		check_fill_kernel(r0to1bf_kernel_avx512, "avx512");
+#endif
+}
+
+int
+main(int argc, char **argv)
+{
+	test_narrowing();
+	test_ranges();
+	test_rdf_positive_n(2);
+	test_rdf_positive_n(3);
+	test_rdf_positive_n(17);
+	check_fill();
+	test_0to1();
+	return 0;
+}
@@ -0,0 +1,874 @@
+/*
+ * Copyright (c) 2015 Artur Grabowski <art@blahonga.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <float.h>
+#include <math.h>
+#include <assert.h>
+#include <strings.h>
+#include <time.h>
+
+#include "rX.h"
+#include "rX_sources.h"
+#include "r0to1.h"
+#include "rd_range.h"
+#include "gof.h"
+
+/*
+ * Everything in rd.c and arbitrary_range.c, but for long double and
+ * __float128.
+ *
+ * rd.c stops at binary64 because the mantissa has to fit in an
+ * integer. The x87 long double has a 64 bit mantissa (with the
+ * integer bit stored, not implied) and __float128 (IEEE 754 binary128)
+ * has 113 bits of precision. The compilers that have __float128 also
+ * have unsigned __int128, so the same algorithms work with a wider
+ * integer. What doesn't just work is r_uniform: a range can have up to
+ * 2^113 numbers, and the bounded random number then needs a 128x128
+ * bit multiplication, see r_uniform128 below.
+ *
+ * The __float128 arithmetic is in libgcc, libquadmath isn't needed.
+ * This is x86 only, long double is either binary128 or the same as
+ * double everywhere else.
+ */
+#if LDBL_MANT_DIG != 64 || !defined(__SIZEOF_FLOAT128__)
+#error "rdl.c needs an x87 long double and __float128"
+#endif
+
+typedef unsigned __int128 u128;
+
+/*
+ * rX() for up to 128 bits.
+ */
+static u128
+rX128(int bits)
+{
+	u128 hi;
+
+	if (bits <= 64)
+		return rX(bits);
+	hi = rX(bits - 64);
+	return hi << 64 | rX(64);
+}
+
+static int
+ffs128(u128 r)
+{
+	uint64_t lo = r, hi = r >> 64;
+
+	return lo ? ffsll(lo) : hi ? 64 + ffsll(hi) : 0;
+}
+
+static int
+ctz128(u128 r)
+{
+	uint64_t lo = r, hi = r >> 64;
+
+	return lo ? __builtin_ctzll(lo) : 64 + __builtin_ctzll(hi);
+}
+
+static u128
+q_bits(__float128 q)
+{
+	u128 u;
+
+	memcpy(&u, &q, sizeof(u));
+	return u;
+}
+
+static __float128
+q_make(u128 u)
+{
+	__float128 q;
+
+	memcpy(&q, &u, sizeof(q));
+	return q;
+}
+
+/*
+ * An x87 long double is 64 bits of mantissa followed by 16 bits of
+ * sign and exponent, and then padding.
+ */
+static long double
+ld_make(uint64_t mant, int E)
+{
+	long double x = 0;
+	uint16_t se = E;
+
+	memcpy(&x, &mant, sizeof(mant));
+	memcpy((char *)&x + sizeof(mant), &se, sizeof(se));
+	return x;
+}
+
+/*
+ * r0to1b with 64 bits instead of 53. rX(64) has one bit more than the
+ * 63 we can use for the exponent, just like the 53rd bit in r0to1b,
+ * and when that's the only one set it's 0.0. The mantissa of a long
+ * double is 64 bits with the integer bit stored, so it's m with the
+ * top bit set. ldexpl takes twice as long as everything else, so the
+ * bits are put together directly, like in r0to1full in rd.c.
+ */
+static long double
+r0to1bl(void)
+{
+	uint64_t r = rX(64);
+	int e = ffsll(r);
+	uint64_t m;
+
+	if (e > 63 || e == 0) {
+		RX_STAT_ADD(zeros, 1);
+		return 0.0L;
+	}
+	m = (r >> e) << (e - 1);
+	return ld_make(1ULL << 63 | m, 16383 - e);
+}
+
+/*
+ * And with 113, the same way.
+ */
+static __float128
+r0to1bq(void)
+{
+	u128 r = rX128(113), m;
+	int e = ffs128(r);
+
+	if (e > 112 || e == 0) {
+		RX_STAT_ADD(zeros, 1);
+		return 0.0;
+	}
+	m = (r >> e) << (e - 1);
+	return q_make((u128)(16383 - e) << 112 | m);
+}
+
+/*
+ * rd_range_count from rd_range.h, on the mantissa and exponent of
+ * from and to as m * 2^e (with the bias still in e and e = 1 for
+ * subnormals) for a format with p bits of precision. The count fits
+ * in p + 1 bits and first (from rounded up to a multiple of the step,
+ * in steps) in p.
+ *
+ * The step is the ulp of nextafter(to, from). With a long double that
+ * isn't the bits of `to` minus one since the integer bit is stored,
+ * but nextafter(to, from) is only in the binade below when `to` is
+ * the first number in its binade, so that's checked instead. The
+ * exponent of the step (in the same scale as e) is returned in *sp.
+ */
+static u128
+wide_range_count(u128 mf, int ef, u128 mt, int et, int p, u128 *firstp, int *sp)
+{
+	int s = mt == (u128)1 << (p - 1) && et > 1 ? et - 1 : et;
+	int sh = s - ef < 127 ? s - ef : 127;
+
+	*firstp = (mf >> sh) + ((mf & (((u128)1 << sh) - 1)) != 0);
+	*sp = s;
+	return (mt << (et - s)) - *firstp;
+}
+
+/*
+ * k times the step with exponent s, put together from the bits. It's
+ * exact since k has at most as many bits as the mantissa, and it's
+ * much faster than the conversion and multiplication, which for
+ * __float128 are done in software.
+ */
+static long double
+ld_scale(uint64_t k, int s)
+{
+	int top, E;
+
+	if (k == 0)
+		return 0.0L;
+	top = 63 - __builtin_clzll(k);
+	E = top + s - 63;
+	if (E < 1)
+		return ld_make(k << (s - 1), 0);
+	return ld_make(k << (63 - top), E);
+}
+
+static __float128
+q_scale(u128 k, int s)
+{
+	const u128 M = ((u128)1 << 112) - 1;
+	uint64_t hi = k >> 64;
+	int top, E;
+
+	if (k == 0)
+		return 0.0;
+	top = hi ? 127 - __builtin_clzll(hi) : 63 - __builtin_clzll((uint64_t)k);
+	E = top + s - 112;
+	if (E < 1)
+		return q_make(k << (s - 1));
+	return q_make((u128)E << 112 | ((k << (112 - top)) & M));
+}
+
+static u128
+rdl_range_count(long double from, long double to, u128 *firstp, int *sp)
+{
+	uint64_t mf, mt;
+	uint16_t ef, et;
+
+	assert(from >= 0 && to > 0 && from < to && to < INFINITY);
+	memcpy(&mf, &from, sizeof(mf));
+	memcpy(&ef, (char *)&from + sizeof(mf), sizeof(ef));
+	memcpy(&mt, &to, sizeof(mt));
+	memcpy(&et, (char *)&to + sizeof(mt), sizeof(et));
+	ef &= 0x7fff;			/* -0.0 */
+
+	return wide_range_count(mf, ef + (ef == 0), mt, et + (et == 0), 64, firstp, sp);
+}
+
+static u128
+rdq_range_count(__float128 from, __float128 to, u128 *firstp, int *sp)
+{
+	const u128 M = ((u128)1 << 112) - 1;
+	u128 f = q_bits(from) & (M | (u128)0x7fff << 112), t = q_bits(to);
+	int ef = f >> 112, et = t >> 112;
+
+	assert(from >= 0 && to > 0 && from < to && to < INFINITY);
+	return wide_range_count((f & M) | (u128)(ef != 0) << 112, ef + (ef == 0),
+	    (t & M) | (u128)(et != 0) << 112, et + (et == 0), 113, firstp, sp);
+}
+
+static u128
+numbers_betweenl(long double from, long double to)
+{
+	u128 first;
+	int s;
+
+	return rdl_range_count(from, to, &first, &s);
+}
+
+static u128
+numbers_betweenq(__float128 from, __float128 to)
+{
+	u128 first;
+	int s;
+
+	return rdq_range_count(from, to, &first, &s);
+}
+
+/*
+ * The 256 bit product of a and b from four 64x64->128 bit
+ * multiplications. The high half goes in *hi, the low half is
+ * returned.
+ */
+static u128
+mul256(u128 a, u128 b, u128 *hi)
+{
+	u128 a0 = (uint64_t)a, a1 = a >> 64, b0 = (uint64_t)b, b1 = b >> 64;
+	u128 p00 = a0 * b0, p01 = a0 * b1, p10 = a1 * b0, p11 = a1 * b1;
+	u128 mid = (p00 >> 64) + (uint64_t)p01 + (uint64_t)p10;
+
+	*hi = p11 + (p01 >> 64) + (p10 >> 64) + (mid >> 64);
+	return (uint64_t)p00 | mid << 64;
+}
+
+/*
+ * r_uniform from arbitrary_range.c for bounds up to 2^128 - 1.
+ * Lemire's method works for any width: take a k bit random number r
+ * with upper_bound <= 2^k, the result is the top k bits of
+ * r * upper_bound and it's rejected when the bottom k bits are less
+ * than 2^k % upper_bound. Bounds below 2^64 use k = 64, so every long
+ * double range (at most 2^64 numbers, and 2^64 is a power of two)
+ * consumes exactly what r_uniform would. The rest use k = 128 and
+ * mul256.
+ *
+ * The threshold needs a division, and an unsigned __int128 division
+ * is a call to __umodti3 that takes longer than everything else here.
+ * But just like in r_uniform the threshold is less than upper_bound,
+ * so it's only needed when the bottom bits are. For the counts of
+ * __float128 ranges (less than 2^114) that's at most once every 2^14
+ * numbers, and the prepared ranges below do the division once up
+ * front. Powers of two come straight from rX128.
+ */
+static u128
+r_uniform128(u128 upper_bound)
+{
+	u128 hi, lo, min;
+
+	if (upper_bound < 2)
+		return 0;
+	if ((upper_bound & (upper_bound - 1)) == 0)
+		return rX128(ctz128(upper_bound));
+	if ((upper_bound >> 64) == 0) {
+		uint64_t ub = upper_bound, l;
+		u128 m;
+
+		m = (u128)rX(64) * ub;
+		l = (uint64_t)m;
+		if (l < ub) {
+			uint64_t min = -ub % ub;
+
+			while (l < min) {
+				RX_STAT_ADD(rejections, 1);
+				m = (u128)rX(64) * ub;
+				l = (uint64_t)m;
+			}
+		}
+		return m >> 64;
+	}
+
+	lo = mul256(rX128(128), upper_bound, &hi);
+	if (lo < upper_bound) {
+		min = -upper_bound % upper_bound;
+		while (lo < min) {
+			RX_STAT_ADD(rejections, 1);
+			lo = mul256(rX128(128), upper_bound, &hi);
+		}
+	}
+	return hi;
+}
+
+/*
+ * rd_positive, the number is (first + k) * step.
+ */
+static long double
+rd_positivel(long double from, long double to)
+{
+	u128 first, count;
+	int s;
+
+	count = rdl_range_count(from, to, &first, &s);
+	return ld_scale(first + r_uniform128(count), s);
+}
+
+static __float128
+rd_positiveq(__float128 from, __float128 to)
+{
+	u128 first, count;
+	int s;
+
+	count = rdq_range_count(from, to, &first, &s);
+	return q_scale(first + r_uniform128(count), s);
+}
+
+/*
+ * The prepared ranges, like struct rd_range in rd_range.h.
+ */
+struct rdw_bound {
+	u128 first;
+	u128 count;
+	u128 min;		/* 2**64 or 2**128 % count, see r_uniform128. */
+	int bits;		/* count == 2^bits, 0 if it isn't a power of two. */
+	int s;			/* The exponent of the step, see ld_scale. */
+};
+
+struct rdl_range {
+	long double step;
+	struct rdw_bound b;
+};
+
+struct rdq_range {
+	__float128 step;
+	struct rdw_bound b;
+};
+
+static void
+rdw_bound_init(struct rdw_bound *b)
+{
+	if ((b->count >> 64) == 0)
+		b->min = -(uint64_t)b->count % (uint64_t)b->count;
+	else
+		b->min = -b->count % b->count;
+	b->bits = b->count > 1 && (b->count & (b->count - 1)) == 0 ?
+	    ctz128(b->count) : 0;
+}
+
+/*
+ * r_uniform128 with the threshold already known. Same numbers from the
+ * same bits, except for a count of 1, which costs 64 bits like it does
+ * in rd_range_draw.
+ */
+static u128
+rdw_bound_draw(const struct rdw_bound *b)
+{
+	u128 hi, lo;
+
+	if (b->bits)
+		return b->first + rX128(b->bits);
+	if ((b->count >> 64) == 0)
+		return b->first + r_uniform_min(b->count, b->min);
+	lo = mul256(rX128(128), b->count, &hi);
+	while (lo < b->min) {
+		RX_STAT_ADD(rejections, 1);
+		lo = mul256(rX128(128), b->count, &hi);
+	}
+	return b->first + hi;
+}
+
+static void
+rdl_range_init(struct rdl_range *rr, long double from, long double to)
+{
+	rr->b.count = rdl_range_count(from, to, &rr->b.first, &rr->b.s);
+	rr->step = ld_scale(1, rr->b.s);
+	rdw_bound_init(&rr->b);
+}
+
+static long double
+rdl_range_draw(const struct rdl_range *rr)
+{
+	return ld_scale(rdw_bound_draw(&rr->b), rr->b.s);
+}
+
+static void
+rdq_range_init(struct rdq_range *rr, __float128 from, __float128 to)
+{
+	rr->b.count = rdq_range_count(from, to, &rr->b.first, &rr->b.s);
+	rr->step = q_scale(1, rr->b.s);
+	rdw_bound_init(&rr->b);
+}
+
+static __float128
+rdq_range_draw(const struct rdq_range *rr)
+{
+	return q_scale(rdw_bound_draw(&rr->b), rr->b.s);
+}
+
+/*
+ * Tests.
+ */
+#define GOF_ALPHA 1e-6
+
+static void
+print128(const char *name, u128 v)
+{
+	printf("%s0x%016" PRIx64 "%016" PRIx64, name, (uint64_t)(v >> 64), (uint64_t)v);
+}
+
+/*
+ * Against schoolbook multiplication with 32 bit digits.
+ */
+static void
+test_mul256(void)
+{
+	int n, i, j;
+
+	for (n = 0; n < 100000; n++) {
+		u128 a = rX128(128) >> rX(7), b = rX128(128) >> rX(7), hi, lo;
+		uint32_t x[4], y[4], r[8] = { 0 };
+		uint64_t t, carry;
+
+		if (n == 0)
+			a = b = ~(u128)0;
+		for (i = 0; i < 4; i++) {
+			x[i] = a >> (32 * i);
+			y[i] = b >> (32 * i);
+		}
+		for (i = 0; i < 4; i++) {
+			carry = 0;
+			for (j = 0; j < 4; j++) {
+				t = (uint64_t)x[i] * y[j] + r[i + j] + carry;
+				r[i + j] = t;
+				carry = t >> 32;
+			}
+			r[i + 4] = carry;
+		}
+		lo = mul256(a, b, &hi);
+		for (i = 0; i < 4; i++) {
+			if ((uint32_t)(lo >> (32 * i)) != r[i] ||
+			    (uint32_t)(hi >> (32 * i)) != r[i + 4]) {
+				print128("mul256: ", a);
+				print128(" * ", b);
+				printf("\n");
+				abort();
+			}
+		}
+	}
+}
+
+static void
+test_rangesl(void)
+{
+	static const long double r[][2] = {
+		{ 0x1p63L, 0x1p63L + 3 }, { 0x1p66L, 0x1p66L + 25 },
+		{ 0, 0x1p64L + 2 }, { 0, 1 }, { 0x1.8p-64L, 1 },
+		{ 0.3L, 0.7L }, { 3, 0x1p63L + 1000 }, { 0x1p-16445L, 0x1p1000L },
+		{ 0, 0x1p-16445L }, { -0.0L, 0x1p-16382L },
+	};
+	struct rdl_range rr;
+	long double step;
+	u128 first, count;
+	size_t i;
+	int s;
+
+	assert(numbers_betweenl(0x1p63L, 0x1p63L + 3) == 3);
+	assert(numbers_betweenl(0x1p66L, 0x1p66L + 25) == 3);
+	assert(numbers_betweenl(0, 0x1p64L + 2) == (1ULL << 63) + 1);
+	assert(numbers_betweenl(0, 1) == (u128)1 << 64);
+	assert(numbers_betweenl(0x1.8p-64L, 1) == ((u128)1 << 64) - 2);
+	assert(numbers_betweenl(3, 0x1p63L + 1000) == (1ULL << 63) + 997);
+	assert(numbers_betweenl(0x1p-16445L, 0x1p1000L) == ((u128)1 << 64) - 1);
+	assert(numbers_betweenl(0, 0x1p-16445L) == 1);
+	assert(numbers_betweenl(-0.0L, 0x1p-16382L) == 1ULL << 63);
+
+	/*
+	 * The step is what nextafterl says, the numbers are the
+	 * multiples of the step in the range and ld_scale agrees with
+	 * the floating point math.
+	 */
+	for (i = 0; i < sizeof(r) / sizeof(r[0]); i++) {
+		count = rdl_range_count(r[i][0], r[i][1], &first, &s);
+		step = ld_scale(1, s);
+		assert(step == r[i][1] - nextafterl(r[i][1], r[i][0]));
+		assert((long double)(uint64_t)first * step >= r[i][0]);
+		assert(first == 0 || (long double)(uint64_t)(first - 1) * step < r[i][0]);
+		assert((long double)(first + count) * step == r[i][1]);
+		assert(ld_scale(first + count - 1, s) == (long double)(first + count - 1) * step);
+	}
+
+	rdl_range_init(&rr, 0, 1);
+	assert(rr.b.bits == 64 && rr.step == 0x1p-64L);
+	rdl_range_init(&rr, 0.3L, 0.7L);
+	assert(rr.b.bits == 0 && rr.b.min == -(uint64_t)rr.b.count % (uint64_t)rr.b.count);
+}
+
+static void
+test_rangesq(void)
+{
+	static const __float128 r[][2] = {
+		{ 0x1p112Q, 0x1p112Q + 3 }, { 0x1p115Q, 0x1p115Q + 25 },
+		{ 0, 0x1p113Q + 2 }, { 0, 1 }, { 0x1.8p-113Q, 1 },
+		{ 0.3Q, 0.7Q }, { 3, 0x1p112Q + 1000 }, { 0x1p-16494Q, 0x1p1000Q },
+		{ 0, 0x1p-16494Q }, { -0.0Q, 0x1p-16382Q },
+	};
+	struct rdq_range rr;
+	__float128 step;
+	u128 first, count;
+	size_t i;
+	int s;
+
+	assert(numbers_betweenq(0x1p112Q, 0x1p112Q + 3) == 3);
+	assert(numbers_betweenq(0x1p115Q, 0x1p115Q + 25) == 3);
+	assert(numbers_betweenq(0, 0x1p113Q + 2) == ((u128)1 << 112) + 1);
+	assert(numbers_betweenq(0, 1) == (u128)1 << 113);
+	assert(numbers_betweenq(0x1.8p-113Q, 1) == ((u128)1 << 113) - 2);
+	assert(numbers_betweenq(3, 0x1p112Q + 1000) == ((u128)1 << 112) + 997);
+	assert(numbers_betweenq(0x1p-16494Q, 0x1p1000Q) == ((u128)1 << 113) - 1);
+	assert(numbers_betweenq(0, 0x1p-16494Q) == 1);
+	assert(numbers_betweenq(-0.0Q, 0x1p-16382Q) == (u128)1 << 112);
+
+	/* There's no nextafterq without libquadmath, but here it's the bits minus one. */
+	for (i = 0; i < sizeof(r) / sizeof(r[0]); i++) {
+		count = rdq_range_count(r[i][0], r[i][1], &first, &s);
+		step = q_scale(1, s);
+		assert(step == r[i][1] - q_make(q_bits(r[i][1]) - 1));
+		assert((__float128)first * step >= r[i][0]);
+		assert(first == 0 || (__float128)(first - 1) * step < r[i][0]);
+		assert((__float128)(first + count) * step == r[i][1]);
+		assert(q_scale(first + count - 1, s) == (__float128)(first + count - 1) * step);
+	}
+
+	rdq_range_init(&rr, 0, 1);
+	assert(rr.b.bits == 113 && rr.step == 0x1p-113Q);
+	rdq_range_init(&rr, 0.3Q, 0.7Q);
+	assert(rr.b.bits == 0 && rr.b.min == -rr.b.count % rr.b.count);
+}
+
+/*
+ * Bounds below 2^64 must take exactly the same bits as r_uniform_min,
+ * and above that the rejections have to happen as often as they
+ * should: for 2^127 + 1 the threshold is 2^127 - 1, so almost half
+ * of the draws are rejected.
+ */
+static void
+test_r_uniform128(void)
+{
+	static const uint64_t b64[] = { 3, 42, 1000000007, (1ULL << 63) + 1, UINT64_MAX };
+	const uint32_t key[8] = { 0x72, 0x64, 0x6c };
+	const u128 ub = ((u128)1 << 127) + 1, ub3 = (u128)3 << 100;
+	const int n = 1000000;
+	struct rx_chacha c;
+	struct gof_hist h;
+	uint64_t draws;
+	double z, p;
+	size_t i;
+	int j;
+
+	for (i = 0; i < sizeof(b64) / sizeof(b64[0]); i++) {
+		uint64_t a[1000];
+
+		rx_chacha_init(&c, key, i, 8);
+		rX_source(rx_chacha_fill, &c);
+		for (j = 0; j < 1000; j++)
+			a[j] = r_uniform128(b64[i]);
+		rx_chacha_init(&c, key, i, 8);
+		rX_source(rx_chacha_fill, &c);
+		for (j = 0; j < 1000; j++)
+			assert(a[j] == r_uniform_min(b64[i], -b64[i] % b64[i]));
+	}
+
+	/* Count the draws by counting the bits. */
+	rx_chacha_init(&c, key, 100, 8);
+	rX_source(rx_chacha_fill, &c);
+	draws = 0;
+	for (j = 0; j < n; j++) {
+		uint64_t pos = rx_res.pos;
+
+		assert(r_uniform128(ub) <= ub - 1);
+		draws += (rx_res.pos - pos + RX_BITS) % RX_BITS / 128;
+	}
+	p = gof_binomial_p(draws - n, draws, 0.5, &z);
+	printf("r_uniform128(2^127 + 1): %" PRIu64 " draws for %d numbers, p %.3g\n",
+	    draws, n, p);
+	if (p < GOF_ALPHA)
+		printf("r_uniform128(2^127 + 1): wrong number of rejections\n");
+	rX_source(rx_arc4random_fill, NULL);
+
+	gof_hist_init(&h, 0, 3, 3);
+	for (j = 0; j < n; j++)
+		gof_hist_add1(&h, (double)(r_uniform128(ub3) >> 100));
+	p = gof_chisq(&h, &z);
+	printf("r_uniform128(3 * 2^100): chi-square %.1f p %.3g\n", z, p);
+	if (p < GOF_ALPHA)
+		printf("r_uniform128(3 * 2^100): not uniform\n");
+	gof_hist_free(&h);
+}
+
+/*
+ * The checks from rd.c on the numbers as integers k = x * 2^p, which
+ * they all have to be. For the numbers in [2^-(o+1), 2^-o) the top
+ * bit of k is bit p - 1 - o and every bit below it should be seen.
+ */
+struct rw_test {
+	uint64_t n;
+	uint64_t efreq[113];
+	u128 m_bits_set[113];
+};
+
+static void
+Bw(u128 k, int p, struct rw_test *rt)
+{
+	uint64_t hi = k >> 64;
+	int top, o;
+
+	rt->n++;
+	if (k == 0)
+		return;
+	top = hi ? 127 - __builtin_clzll(hi) : 63 - __builtin_clzll((uint64_t)k);
+	assert(top < p);
+	o = p - 1 - top;
+	rt->efreq[o]++;
+	rt->m_bits_set[o] |= k;
+}
+
+static void
+check_bits(const char *name, const struct rw_test *rt, int p)
+{
+	double z, pv;
+	int o;
+
+	for (o = 0; o < p; o++) {
+		u128 expected_bits = ((u128)1 << (p - o)) - 1;
+
+		/* Same reasoning for 25 as in rd.c. */
+		if (rt->m_bits_set[o] != expected_bits && rt->efreq[o] > 25) {
+			printf("%s bits[%d]: ", name, o);
+			print128("", rt->m_bits_set[o]);
+			print128(", expected ", expected_bits);
+			printf("\n");
+		}
+		/* The normal approximation needs something to approximate. */
+		if (ldexp(rt->n, -o - 1) < 100)
+			continue;
+		pv = gof_binomial_p(rt->efreq[o], rt->n, ldexp(1.0, -o - 1), &z);
+		if (pv < GOF_ALPHA)
+			printf("%s freq[%d]: %" PRIu64 ", %.1f standard deviations off\n",
+			    name, -o - 1, rt->efreq[o], z);
+	}
+}
+
+static void
+test_0to1(void)
+{
+	const int numruns = 1 << 22;
+	struct rw_test ta = { 0 }, tb = { 0 }, tc = { 0 }, td = { 0 };
+	struct rdl_range rl;
+	struct rdq_range rq;
+	int i;
+
+	rdl_range_init(&rl, 0, 1);
+	rdq_range_init(&rq, 0, 1);
+	for (i = 0; i < numruns; i++) {
+		long double a = r0to1bl(), b = rdl_range_draw(&rl);
+		__float128 c = r0to1bq(), d = rdq_range_draw(&rq);
+		uint64_t ka = ldexpl(a, 64), kb = ldexpl(b, 64);
+		u128 kc = c * 0x1p113Q, kd = d * 0x1p113Q;
+
+		assert(a >= 0 && a < 1 && b >= 0 && b < 1 && c >= 0 && c < 1 && d >= 0 && d < 1);
+		assert((long double)ka == ldexpl(a, 64) && (long double)kb == ldexpl(b, 64));
+		assert((__float128)kc == c * 0x1p113Q && (__float128)kd == d * 0x1p113Q);
+		Bw(ka, 64, &ta);
+		Bw(kb, 64, &tb);
+		Bw(kc, 113, &tc);
+		Bw(kd, 113, &td);
+	}
+	check_bits("r0to1bl", &ta, 64);
+	check_bits("rdl_range", &tb, 64);
+	check_bits("r0to1bq", &tc, 113);
+	check_bits("rdq_range", &td, 113);
+}
+
+/*
+ * test_rd_positive_n from arbitrary_range.c, right where the numbers
+ * are integers.
+ */
+static void
+test_rd_positive_n(int buckets)
+{
+	const int attempts = 10000000;
+	const long double froml = 0x1p63L;
+	const __float128 fromq = 0x1p112Q;
+	struct gof_hist hl, hq;
+	double chil, chiq, pl, pq;
+	int i;
+
+	gof_hist_init(&hl, 0, buckets, buckets);
+	gof_hist_init(&hq, 0, buckets, buckets);
+	for (i = 0; i < attempts; i++) {
+		long double l = rd_positivel(froml, froml + buckets);
+		__float128 q = rd_positiveq(fromq, fromq + buckets);
+
+		assert(l >= froml && l < froml + buckets);
+		assert(q >= fromq && q < fromq + buckets);
+		gof_hist_add1(&hl, (double)(l - froml));
+		gof_hist_add1(&hq, (double)(q - fromq));
+	}
+	pl = gof_chisq(&hl, &chil);
+	pq = gof_chisq(&hq, &chiq);
+	printf("rd_positivel(2^63, +%d): chi-square %.1f p %.3g, "
+	    "rd_positiveq(2^112, +%d): chi-square %.1f p %.3g\n",
+	    buckets, chil, pl, buckets, chiq, pq);
+	if (pl < GOF_ALPHA)
+		printf("rd_positivel(2^63, +%d): not uniform\n", buckets);
+	if (pq < GOF_ALPHA)
+		printf("rd_positiveq(2^112, +%d): not uniform\n", buckets);
+	gof_hist_free(&hl);
+	gof_hist_free(&hq);
+}
+
+/*
+ * How much does the extra precision cost? Against the binary64
+ * versions from r0to1.h and rd_range.h.
+ */
+
+static struct {
+	struct rx_chacha c;
+	uint64_t refills;
+} counted;
+
+static void
+counted_fill(void *arg, uint64_t *buf, size_t n)
+{
+	(void)arg;
+	counted.refills++;
+	rx_chacha_fill(&counted.c, buf, n);
+}
+
+static uint64_t
+bits_used(void)
+{
+	return counted.refills * RX_BITS + rx_res.pos;
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+#define SPEED_N (1 << 22)
+
+static uint64_t sink;
+
+/*
+ * Best of three, the low 64 bits of every number go into sink so
+ * that nothing is optimized away and no conversion is measured.
+ */
+#define SPEED(name, type, expr) do {					\
+	double best = 1e9, bits = 0;					\
+	int run, i;							\
+	for (run = 0; run < 3; run++) {					\
+		uint64_t b0 = bits_used(), u;				\
+		double t = now();					\
+		for (i = 0; i < SPEED_N; i++) {				\
+			type v = (expr);				\
+			memcpy(&u, &v, sizeof(u));			\
+			sink ^= u;					\
+		}							\
+		t = now() - t;						\
+		if (t < best)						\
+			best = t;					\
+		bits = (double)(bits_used() - b0) / SPEED_N;		\
+	}								\
+	printf("%-28s %7.2f ns/number %7.2f bits/number\n", name,	\
+	    best * 1e9 / SPEED_N, bits);				\
+} while (0)
+
+static void
+speed(void)
+{
+	const uint32_t key[8] = { 0x62656e63, 0x68 };
+	struct rd_range rd01, rd37;
+	struct rdl_range rl01, rl37;
+	struct rdq_range rq01, rq37;
+
+	rx_chacha_init(&counted.c, key, 0, 8);
+	rX_source(counted_fill, NULL);
+
+	rd_range_init(&rd01, 0, 1);
+	rd_range_init(&rd37, 0.3, 0.7);
+	rdl_range_init(&rl01, 0, 1);
+	rdl_range_init(&rl37, 0.3L, 0.7L);
+	rdq_range_init(&rq01, 0, 1);
+	rdq_range_init(&rq37, 0.3Q, 0.7Q);
+
+	SPEED("r0to1b", double, r0to1b_bits(rX(53)));
+	SPEED("r0to1bl", long double, r0to1bl());
+	SPEED("r0to1bq", __float128, r0to1bq());
+	SPEED("rd_range [0,1)", double, rd_range_draw(&rd01));
+	SPEED("rdl_range [0,1)", long double, rdl_range_draw(&rl01));
+	SPEED("rdq_range [0,1)", __float128, rdq_range_draw(&rq01));
+	SPEED("rd_range [0.3,0.7)", double, rd_range_draw(&rd37));
+	SPEED("rdl_range [0.3,0.7)", long double, rdl_range_draw(&rl37));
+	SPEED("rdq_range [0.3,0.7)", __float128, rdq_range_draw(&rq37));
+	SPEED("rd_positive [0.3,0.7)", double, rd_positive(0.3, 0.7));
+	SPEED("rd_positivel [0.3,0.7)", long double, rd_positivel(0.3L, 0.7L));
+	SPEED("rd_positiveq [0.3,0.7)", __float128, rd_positiveq(0.3Q, 0.7Q));
+
+	rX_source(rx_arc4random_fill, NULL);
+	if (sink == 42)
+		printf("\n");
+}
+
+int
+main(int argc, char **argv)
+{
+	test_mul256();
+	test_rangesl();
+	test_rangesq();
+	test_r_uniform128();
+	test_0to1();
+	test_rd_positive_n(2);
+	test_rd_positive_n(3);
+	test_rd_positive_n(17);
+	speed();
+	return 0;
+}
@@ -0,0 +1,369 @@
+/*
+ * Copyright (c) 2015 Artur Grabowski <art@blahonga.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#define _GNU_SOURCE		/* O_DIRECT */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include "rX.h"
+#include "rX_sources.h"
+#include "r0to1.h"
+#include "rd_range.h"
+
+/*
+ * Stream random doubles in [from,to) to stdout or a file, for programs
+ * that read their random numbers from a pipe.
+ *
+ *	rdstream [-c count] [-s seed] [-t threads] [-x] [-o file [-D]] [from to]
+ *
+ * The default range is [0,1), which is generated with r0to1b_fill,
+ * every other range with a prepared rd_range (positive ranges only,
+ * like rd_range.h). The output is the raw doubles in native byte
+ * order, or with -x one `%a` per line. -c (--count) stops after that
+ * many numbers, the default is to go on until the reader goes away.
+ *
+ * The numbers are generated in chunks of SCHUNK numbers, every chunk
+ * from its own ChaCha8 stream keyed by the seed with the chunk number
+ * as nonce, just like parallel_fill.h (and with the same block size,
+ * so the output is the same as parallel_fill with the same seed and
+ * fill function). With -s (--seed) the output is the same no matter
+ * how many threads there are. Without -s the seed comes from
+ * `arc4random`.
+ *
+ * The threads generate chunks into a ring of buffers twice as big as
+ * the number of threads and the main thread writes them out in order,
+ * as many ready buffers at a time as `writev` takes. The buffers are
+ * page aligned and a whole chunk of binary doubles is a multiple of
+ * the page size, so with -D the file is opened with O_DIRECT and the
+ * page cache is skipped (the last chunk is written without O_DIRECT
+ * since it's probably not a multiple of anything).
+ *
+ * vmsplice(2) would save the copy into the pipe, but the pages stay
+ * in the pipe until the reader gets to them and we would have to know
+ * when that happened before we could generate into the buffer again.
+ * Nothing tells us that, so we copy.
+ *
+ * Compile with -pthread.
+ */
+
+#define SCHUNK (1 << 16)
+#define HEXLEN 24		/* "0x1.fffffffffffffp-1022\n" */
+#define SALIGN 4096
+
+struct slot {
+	char *buf;
+	size_t len;
+	int ready;
+};
+
+struct stream {
+	pthread_mutex_t mtx;
+	pthread_cond_t ready, free;
+	uint64_t count;			/* Numbers to write. */
+	uint64_t next;			/* Next chunk to generate. */
+	uint64_t written;		/* Chunks written. */
+	int stop;
+	int nslots;
+	struct slot *s;
+	int hex;
+	int unit;			/* [0,1), use r0to1b_fill. */
+	struct rd_range rr;
+	uint32_t key[8];
+};
+
+static uint64_t
+chunk_len(struct stream *st, uint64_t c)
+{
+	uint64_t off = c * SCHUNK;
+
+	return st->count - off < SCHUNK ? st->count - off : SCHUNK;
+}
+
+static size_t
+format_hex(char *out, const double *d, size_t n)
+{
+	char *p = out;
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		p += sprintf(p, "%a\n", d[i]);
+	return p - out;
+}
+
+static void *
+stream_thread(void *arg)
+{
+	struct stream *st = arg;
+	struct rx_chacha ch;
+	double *tmp = NULL;
+	uint64_t c, n;
+
+	if (st->hex && (tmp = malloc(SCHUNK * sizeof(*tmp))) == NULL)
+		abort();
+
+	pthread_mutex_lock(&st->mtx);
+	for (;;) {
+		struct slot *s;
+		double *out;
+
+		c = st->next;
+		if (st->stop || c * SCHUNK >= st->count)
+			break;
+		st->next++;
+		s = &st->s[c % st->nslots];
+		while (c >= st->written + st->nslots && !st->stop)
+			pthread_cond_wait(&st->free, &st->mtx);
+		if (st->stop)
+			break;
+		pthread_mutex_unlock(&st->mtx);
+
+		n = chunk_len(st, c);
+		out = st->hex ? tmp : (double *)s->buf;
+		rx_chacha_init(&ch, st->key, c, 8);
+		rX_source(rx_chacha_fill, &ch);
+		if (st->unit)
+			r0to1b_fill(out, n);
+		else
+			rd_range_fill(&st->rr, out, n);
+		s->len = st->hex ? format_hex(s->buf, tmp, n) : n * sizeof(double);
+
+		pthread_mutex_lock(&st->mtx);
+		s->ready = 1;
+		pthread_cond_broadcast(&st->ready);
+	}
+	pthread_mutex_unlock(&st->mtx);
+	free(tmp);
+	return NULL;
+}
+
+/*
+ * Write everything in iov, which writev might not do in one go.
+ */
+static int
+writev_all(int fd, struct iovec *iov, int n)
+{
+	while (n) {
+		ssize_t w = writev(fd, iov, n);
+
+		if (w < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		while (n && (size_t)w >= iov->iov_len) {
+			w -= iov->iov_len;
+			iov++;
+			n--;
+		}
+		if (n) {
+			iov->iov_base = (char *)iov->iov_base + w;
+			iov->iov_len -= w;
+		}
+	}
+	return 0;
+}
+
+static int
+stream_write(struct stream *st, int fd, int direct)
+{
+	uint64_t nchunks = st->count / SCHUNK + (st->count % SCHUNK != 0);
+	struct iovec iov[IOV_MAX < 64 ? IOV_MAX : 64];
+	int maxiov = sizeof(iov) / sizeof(iov[0]);
+	int n, ret = 0;
+
+	while (st->written < nchunks) {
+		uint64_t w = st->written;
+
+		pthread_mutex_lock(&st->mtx);
+		while (!st->s[w % st->nslots].ready)
+			pthread_cond_wait(&st->ready, &st->mtx);
+		for (n = 0; n < maxiov && n < st->nslots && w + n < nchunks; n++) {
+			struct slot *s = &st->s[(w + n) % st->nslots];
+
+			if (!s->ready)
+				break;
+			iov[n].iov_base = s->buf;
+			iov[n].iov_len = s->len;
+		}
+		pthread_mutex_unlock(&st->mtx);
+
+		if (direct && w + n == nchunks && st->count % SCHUNK) {
+			/* The last chunk is not a multiple of the block size. */
+			if (n > 1 && writev_all(fd, iov, n - 1)) {
+				ret = -1;
+				break;
+			}
+			fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+			direct = 0;
+			if (writev_all(fd, &iov[n - 1], 1))
+				ret = -1;
+		} else if (writev_all(fd, iov, n)) {
+			ret = -1;
+		}
+		if (ret)
+			break;
+
+		pthread_mutex_lock(&st->mtx);
+		while (n--)
+			st->s[st->written++ % st->nslots].ready = 0;
+		pthread_cond_broadcast(&st->free);
+		pthread_mutex_unlock(&st->mtx);
+	}
+
+	pthread_mutex_lock(&st->mtx);
+	st->stop = 1;
+	pthread_cond_broadcast(&st->free);
+	pthread_mutex_unlock(&st->mtx);
+	return ret;
+}
+
+static void
+usage(const char *name)
+{
+	fprintf(stderr, "usage: %s [-c count] [-s seed] [-t threads] [-x] "
+	    "[-o file [-D]] [from to]\n", name);
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	static const struct option longopts[] = {
+		{ "count", required_argument, NULL, 'c' },
+		{ "seed", required_argument, NULL, 's' },
+		{ "threads", required_argument, NULL, 't' },
+		{ "hex", no_argument, NULL, 'x' },
+		{ "output", required_argument, NULL, 'o' },
+		{ "direct", no_argument, NULL, 'D' },
+		{ NULL, 0, NULL, 0 },
+	};
+	struct stream st;
+	const char *file = NULL;
+	double from = 0.0, to = 1.0;
+	uint64_t seed;
+	pthread_t *thr;
+	int nthreads = 0, direct = 0, seeded = 0;
+	int ch, fd, i, ret;
+
+	memset(&st, 0, sizeof(st));
+	st.count = UINT64_MAX;
+	while ((ch = getopt_long(argc, argv, "c:s:t:xo:D", longopts, NULL)) != -1) {
+		switch (ch) {
+		case 'c':
+			st.count = strtoull(optarg, NULL, 0);
+			break;
+		case 's':
+			seed = strtoull(optarg, NULL, 0);
+			seeded = 1;
+			break;
+		case 't':
+			nthreads = atoi(optarg);
+			break;
+		case 'x':
+			st.hex = 1;
+			break;
+		case 'o':
+			file = optarg;
+			break;
+		case 'D':
+			direct = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc == 2) {
+		from = strtod(argv[0], NULL);
+		to = strtod(argv[1], NULL);
+	} else if (argc != 0) {
+		usage(argv[0]);
+	}
+	if (!(from >= 0 && to > 0 && from < to && to < INFINITY)) {
+		fprintf(stderr, "[%a, %a) is not a positive range\n", from, to);
+		return 1;
+	}
+	if (direct && (st.hex || file == NULL)) {
+		fprintf(stderr, "-D needs -o and binary output\n");
+		return 1;
+	}
+	if (!seeded)
+		seed = (uint64_t)arc4random() << 32 | arc4random();
+	if (nthreads <= 0)
+		nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nthreads < 1)
+		nthreads = 1;
+
+	st.unit = from == 0.0 && to == 1.0;
+	if (!st.unit)
+		rd_range_init(&st.rr, from, to);
+	st.key[0] = seed;
+	st.key[1] = seed >> 32;
+
+	if (file) {
+		fd = open(file, O_WRONLY | O_CREAT | O_TRUNC | (direct ? O_DIRECT : 0), 0666);
+		if (fd == -1) {
+			perror(file);
+			return 1;
+		}
+	} else {
+		fd = STDOUT_FILENO;
+	}
+	/* A reader that goes away is how an endless stream ends. */
+	signal(SIGPIPE, SIG_IGN);
+
+	pthread_mutex_init(&st.mtx, NULL);
+	pthread_cond_init(&st.ready, NULL);
+	pthread_cond_init(&st.free, NULL);
+	st.nslots = 2 * nthreads;
+	if ((st.s = calloc(st.nslots, sizeof(*st.s))) == NULL ||
+	    (thr = calloc(nthreads, sizeof(*thr))) == NULL)
+		abort();
+	for (i = 0; i < st.nslots; i++) {
+		size_t sz = SCHUNK * (st.hex ? HEXLEN + 1 : sizeof(double));
+
+		if ((st.s[i].buf = aligned_alloc(SALIGN, sz)) == NULL)
+			abort();
+	}
+
+	for (i = 0; i < nthreads; i++)
+		if (pthread_create(&thr[i], NULL, stream_thread, &st))
+			abort();
+	ret = stream_write(&st, fd, direct) ? errno : 0;
+	for (i = 0; i < nthreads; i++)
+		pthread_join(thr[i], NULL);
+
+	if (ret && ret != EPIPE) {
+		fprintf(stderr, "write: %s\n", strerror(ret));
+		return 1;
+	}
+	if (file && close(fd)) {
+		perror(file);
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,522 @@
+/*
+ * Copyright (c) 2015 Artur Grabowski <art@blahonga.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <math.h>
+#include <assert.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "rX.h"
+#include "rX_sources.h"
+#include "r0to1.h"
+#include "rd_range.h"
+#include "gof.h"
+
+/*
+ * The statistics in rd.c are done on 2^25 numbers. A number in [0,1)
+ * from r0to1b has the exponent -n with probability 2^-n, so 2^25
+ * numbers tell us nothing about anything below 2^-20 or so, which is
+ * why rd.c only looks at the mantissa when an exponent has been seen
+ * at least 25 times. The deep exponents are where a mistake in the
+ * bit fiddling would hide.
+ *
+ * This does the same checks as B() in rd.c, but on 2^28 numbers by
+ * default and 2^36 or more with `-n 36` for the full run, which takes
+ * a while even on a big machine. The numbers are generated in shards
+ * of VSHARD numbers, every shard from its own ChaCha8 stream (seed as
+ * key, shard number as nonce, just like parallel_fill.h), so the
+ * result doesn't depend on the number of threads. Each thread keeps
+ * its own r1_test and a gof.h histogram of VBUCKETS buckets, and they
+ * are added together at the end.
+ *
+ *	validate [-n log2 numbers] [-t threads] [-s seed] [r0to1b|fill|range ...]
+ *
+ * Compile with -pthread.
+ */
+
+#define VSHARD (1 << 20)
+#define VBUF 4096
+#define NEXP 53		/* r0to1b goes down to 2^-52, rd_range to 2^-53. */
+#define VBUCKETS (1 << 16)	/* Divides 2^53, every bucket is equally likely. */
+
+/*
+ * r1_test from rd.c, but min and max are kept as the bits of the
+ * double. For positive doubles the order of the bits is the order
+ * of the numbers, which lets the SIMD code below use integer min/max.
+ */
+struct r1_test {
+	uint64_t zero;
+	uint64_t efreq[NEXP];
+	uint64_t m_bits_set[NEXP];
+	uint64_t min[NEXP], max[NEXP];
+} __attribute__((aligned(64)));
+
+static void
+r1_test_init(struct r1_test *rt)
+{
+	memset(rt, 0, sizeof(*rt));
+	memset(rt->min, 0xff, sizeof(rt->min));
+}
+
+static void
+r1_test_merge(struct r1_test *to, const struct r1_test *from)
+{
+	int o;
+
+	to->zero += from->zero;
+	for (o = 0; o < NEXP; o++) {
+		to->efreq[o] += from->efreq[o];
+		to->m_bits_set[o] |= from->m_bits_set[o];
+		if (from->min[o] < to->min[o])
+			to->min[o] = from->min[o];
+		if (from->max[o] > to->max[o])
+			to->max[o] = from->max[o];
+	}
+}
+
+static double
+bits2d(uint64_t u)
+{
+	double d;
+
+	memcpy(&d, &u, sizeof(d));
+	return d;
+}
+
+/*
+ * B() from rd.c. A number with exponent e = -o - 1 is a multiple of
+ * 2^-53, so the low o bits of the mantissa must be 0.
+ */
+static void
+B(double r, struct r1_test *rt)
+{
+	uint64_t u, m;
+	int E, o;
+
+	memcpy(&u, &r, sizeof(u));
+	if (u == 0) {
+		rt->zero++;
+		return;
+	}
+	E = u >> 52;		/* The sign bit makes negative numbers fail this. */
+	if (E > 1022 || E < 1022 - (NEXP - 1)) {
+		printf("B(e): %a has exponent %d, outside [-%d,-1]\n", r, E - 1023, NEXP);
+		abort();
+	}
+	o = 1022 - E;
+	m = u & ((1ULL << 52) - 1);
+	if (m & ((1ULL << o) - 1)) {
+		printf("B(m): %a has unexpected bits set: 0x%" PRIx64 "\n", r,
+		    (uint64_t)(m & ((1ULL << o) - 1)));
+		abort();
+	}
+	rt->efreq[o]++;
+	rt->m_bits_set[o] |= m;
+	if (u < rt->min[o])
+		rt->min[o] = u;
+	if (u > rt->max[o])
+		rt->max[o] = u;
+}
+
+static void
+classify_scalar(const double *v, size_t n, struct r1_test *rt)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		B(v[i], rt);
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+
+/*
+ * Half of the numbers have exponent -1, a quarter -2 and so on, so
+ * the top VFAST exponents are 15 out of every 16 numbers. Those are
+ * classified 8 at a time: compare the exponents against each of them,
+ * check the low mantissa bits and update the counts, bits, min and
+ * max under the mask. Anything else (deeper exponents, zero and
+ * broken numbers) is remembered and goes through B() one at a time
+ * after every VCHUNK numbers, which also gives us the same error
+ * messages. Calling B() in the middle of the vector loop would make
+ * the compiler keep all the accumulators in memory.
+ */
+#define VFAST 4
+#define VCHUNK 512
+
+__attribute__((target("avx512f")))
+static void
+classify_avx512(const double *v, size_t n, struct r1_test *rt)
+{
+	const __m512i mmask = _mm512_set1_epi64((1ULL << 52) - 1);
+	__m512i bits[VFAST], min[VFAST], max[VFAST], exp[VFAST], low[VFAST];
+	uint64_t freq[VFAST] = { 0 };
+	uint8_t slow[VCHUNK / 8];
+	size_t i, j;
+	int o;
+
+	for (o = 0; o < VFAST; o++) {
+		bits[o] = _mm512_setzero_si512();
+		min[o] = _mm512_set1_epi64(-1);
+		max[o] = _mm512_setzero_si512();
+		exp[o] = _mm512_set1_epi64(1022 - o);
+		low[o] = _mm512_set1_epi64((1ULL << o) - 1);
+	}
+
+	for (i = 0; i + 8 <= n; i += j) {
+		for (j = 0; j < VCHUNK && i + j + 8 <= n; j += 8) {
+			__m512i x = _mm512_loadu_si512(v + i + j);
+			__m512i E = _mm512_srli_epi64(x, 52);
+			__m512i m = _mm512_and_si512(x, mmask);
+			__mmask8 done = 0;
+
+#pragma GCC unroll 8
+			for (o = 0; o < VFAST; o++) {
+				__mmask8 k = _mm512_mask_testn_epi64_mask(
+				    _mm512_cmpeq_epi64_mask(E, exp[o]), m, low[o]);
+				freq[o] += __builtin_popcount(k);
+				bits[o] = _mm512_mask_or_epi64(bits[o], k, bits[o], m);
+				min[o] = _mm512_mask_min_epu64(min[o], k, min[o], x);
+				max[o] = _mm512_mask_max_epu64(max[o], k, max[o], x);
+				done |= k;
+			}
+			slow[j / 8] = done ^ 0xff;
+		}
+		for (j = 0; j < VCHUNK && i + j + 8 <= n; j += 8) {
+			unsigned int s = slow[j / 8];
+
+			while (s) {
+				B(v[i + j + __builtin_ctz(s)], rt);
+				s &= s - 1;
+			}
+		}
+	}
+	classify_scalar(v + i, n - i, rt);
+
+	for (o = 0; o < VFAST; o++) {
+		uint64_t mi = _mm512_reduce_min_epu64(min[o]);
+		uint64_t ma = _mm512_reduce_max_epu64(max[o]);
+
+		rt->efreq[o] += freq[o];
+		rt->m_bits_set[o] |= _mm512_reduce_or_epi64(bits[o]);
+		if (mi < rt->min[o])
+			rt->min[o] = mi;
+		if (ma > rt->max[o])
+			rt->max[o] = ma;
+	}
+}
+#endif
+
+typedef void (*classify_fn)(const double *, size_t, struct r1_test *);
+
+static classify_fn
+best_classify(void)
+{
+#if defined(__x86_64__) && defined(__GNUC__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f"))
+		return classify_avx512;
+#endif
+	return classify_scalar;
+}
+
+/*
+ * The generators being validated. They all return [0,1).
+ */
+static void
+gen_r0to1b(double *out, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		out[i] = r0to1b_bits(rX(53));
+}
+
+static void
+gen_fill(double *out, size_t n)
+{
+	r0to1b_fill(out, n);
+}
+
+static struct rd_range unit_range;
+
+static void
+gen_range(double *out, size_t n)
+{
+	rd_range_fill(&unit_range, out, n);
+}
+
+static const struct generator {
+	const char *name;
+	void (*gen)(double *, size_t);
+} generators[] = {
+	{ "r0to1b", gen_r0to1b },
+	{ "fill", gen_fill },
+	{ "range", gen_range },
+};
+
+struct validate {
+	const struct generator *g;
+	classify_fn classify;
+	uint64_t n;
+	uint64_t nshards;
+	uint64_t next;		/* Next shard, taken with __atomic_fetch_add. */
+	uint32_t key[8];
+};
+
+struct validate_thread {
+	struct r1_test rt;
+	struct gof_hist h;
+	struct validate *v;
+	pthread_t thr;
+};
+
+static void *
+validate_thread(void *arg)
+{
+	struct validate_thread *vt = arg;
+	struct validate *v = vt->v;
+	static RX_TLS double buf[VBUF];
+	struct rx_chacha c;
+	uint64_t shard;
+
+	r1_test_init(&vt->rt);
+	gof_hist_init(&vt->h, 0.0, 1.0, VBUCKETS);
+	while ((shard = __atomic_fetch_add(&v->next, 1, __ATOMIC_RELAXED)) < v->nshards) {
+		uint64_t left = v->n - shard * VSHARD;
+
+		if (left > VSHARD)
+			left = VSHARD;
+		rx_chacha_init(&c, v->key, shard, 8);
+		rX_source(rx_chacha_fill, &c);
+		while (left) {
+			size_t len = left < VBUF ? left : VBUF;
+
+			v->g->gen(buf, len);
+			v->classify(buf, len, &vt->rt);
+			gof_hist_add(&vt->h, buf, len);
+			left -= len;
+		}
+	}
+	return NULL;
+}
+
+static void
+validate_run(struct validate *v, int nthreads, struct r1_test *rt, struct gof_hist *h)
+{
+	struct validate_thread *vt;
+	int i;
+
+	if ((vt = aligned_alloc(64, nthreads * sizeof(*vt))) == NULL)
+		abort();
+	v->nshards = (v->n + VSHARD - 1) / VSHARD;
+	v->next = 0;
+	for (i = 0; i < nthreads; i++) {
+		vt[i].v = v;
+		if (pthread_create(&vt[i].thr, NULL, validate_thread, &vt[i]))
+			abort();
+	}
+	r1_test_init(rt);
+	gof_hist_init(h, 0.0, 1.0, VBUCKETS);
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(vt[i].thr, NULL);
+		r1_test_merge(rt, &vt[i].rt);
+		gof_hist_merge(h, &vt[i].h);
+		gof_hist_free(&vt[i].h);
+	}
+	free(vt);
+}
+
+/*
+ * The exponent -o - 1 should show up n / 2^(o + 1) times. Complain
+ * when that is more than 6 standard deviations off (p below VALPHA),
+ * which should never happen by chance. All the exponents with enough
+ * numbers together, and the histogram, get the same treatment with
+ * chi-square and Kolmogorov-Smirnov from gof.h.
+ *
+ * Every mantissa bit that is allowed to be set is set by half of the
+ * numbers, so after 64 numbers with the same exponent the chance
+ * that a bit we expect is still missing is 2^-64. That's the 25 from
+ * rd.c without the guessing.
+ */
+#define VALPHA 2e-9
+
+static int
+validate_report(const char *name, const struct r1_test *rt, const struct gof_hist *h,
+    uint64_t n)
+{
+	double chi = 0, chip, d, ksp, z, p;
+	int o, df = -1, fail = 0;
+
+	for (o = 0; o < NEXP; o++) {
+		uint64_t expected_bits = ((1ULL << 52) - 1) ^ ((1ULL << o) - 1);
+		double expected = ldexp(n, -o - 1);
+
+		if (rt->efreq[o] == 0 && expected < 1)
+			continue;
+		p = gof_binomial_p(rt->efreq[o], n, ldexp(1, -o - 1), &z);
+		printf("%s freq[%d]: %" PRIu64 ", expected: %.0f, deviation %.4f (%+.2f sd, p %.3g), "
+		    "range %a - %a\n",
+		    name, -o - 1, rt->efreq[o], expected, rt->efreq[o] / expected, z, p,
+		    rt->efreq[o] ? bits2d(rt->min[o]) : 0.0,
+		    rt->efreq[o] ? bits2d(rt->max[o]) : 0.0);
+		if (expected > 100) {
+			chi += (rt->efreq[o] - expected) * (rt->efreq[o] - expected) / expected;
+			df++;
+			if (p < VALPHA) {
+				printf("%s freq[%d]: FAIL\n", name, -o - 1);
+				fail = 1;
+			}
+		}
+		if (rt->efreq[o] > 64 && rt->m_bits_set[o] != expected_bits) {
+			printf("%s bits[%d]: 0x%" PRIx64 ", expected 0x%" PRIx64 ": FAIL\n",
+			    name, -o - 1, rt->m_bits_set[o], expected_bits);
+			fail = 1;
+		}
+	}
+	printf("%s zero: %" PRIu64 "\n", name, rt->zero);
+	if (df > 0) {
+		chip = gof_chisq_p(chi, df);
+		printf("%s exponents: chi-square %.1f (%d df) p %.3g\n", name, chi, df, chip);
+		if (chip < VALPHA) {
+			printf("%s exponents: FAIL\n", name);
+			fail = 1;
+		}
+	}
+	chip = gof_chisq(h, &chi);
+	ksp = gof_ks(h, &d);
+	printf("%s buckets: chi-square %.1f (%" PRIu64 " df) p %.3g, KS D %.3g p %.3g\n",
+	    name, chi, h->nbuckets - 1, chip, d, ksp);
+	if (chip < VALPHA || ksp < VALPHA) {
+		printf("%s buckets: FAIL\n", name);
+		fail = 1;
+	}
+	return fail;
+}
+
+/*
+ * The SIMD classification must agree with B() about everything,
+ * including the numbers it hands over to B().
+ */
+static void
+check_classify(void)
+{
+	static double a[VBUF + 5];
+	struct r1_test s, f;
+	size_t i;
+
+	for (i = 0; i < VBUF + 5; i++)
+		a[i] = r0to1b_bits(rX(53));
+	a[17] = 0.0;
+	a[18] = 0x1p-53;
+	a[19] = 0x1p-40 + 0x1p-53;
+	r1_test_init(&s);
+	r1_test_init(&f);
+	classify_scalar(a, VBUF + 5, &s);
+	best_classify()(a, VBUF + 5, &f);
+	assert(!memcmp(&s, &f, sizeof(s)));
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int
+main(int argc, char **argv)
+{
+	struct validate v;
+	struct r1_test rt;
+	struct gof_hist h;
+	uint64_t seed = 4711;
+	int log2n = 28, nthreads = 0, fail = 0;
+	int ch, i, a;
+	unsigned g;
+
+	while ((ch = getopt(argc, argv, "n:s:t:")) != -1) {
+		switch (ch) {
+		case 'n':
+			log2n = atoi(optarg);
+			break;
+		case 's':
+			seed = strtoull(optarg, NULL, 0);
+			break;
+		case 't':
+			nthreads = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-n log2 numbers] [-t threads] [-s seed] "
+			    "[r0to1b|fill|range ...]\n", argv[0]);
+			return 1;
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (log2n < 0 || log2n > 62) {
+		fprintf(stderr, "-n %d out of range\n", log2n);
+		return 1;
+	}
+	if (nthreads <= 0)
+		nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nthreads < 1)
+		nthreads = 1;
+
+	check_classify();
+	rd_range_init(&unit_range, 0.0, 1.0);
+
+	memset(&v, 0, sizeof(v));
+	v.classify = best_classify();
+	v.n = 1ULL << log2n;
+	v.key[0] = seed;
+	v.key[1] = seed >> 32;
+	for (g = 0; g < sizeof(generators) / sizeof(generators[0]); g++) {
+		double t;
+
+		v.g = &generators[g];
+		if (argc) {
+			for (a = 0; a < argc && strcmp(argv[a], v.g->name); a++)
+				;
+			if (a == argc)
+				continue;
+		}
+		t = now();
+		validate_run(&v, nthreads, &rt, &h);
+		t = now() - t;
+		fail |= validate_report(v.g->name, &rt, &h, v.n);
+		gof_hist_free(&h);
+		printf("%s: 2^%d numbers, %d threads, %.1f s, %.2f ns/number\n",
+		    v.g->name, log2n, nthreads, t, t * 1e9 / v.n);
+	}
+	for (i = 0; i < argc; i++) {
+		for (g = 0; g < sizeof(generators) / sizeof(generators[0]); g++)
+			if (!strcmp(argv[i], generators[g].name))
+				break;
+		if (g == sizeof(generators) / sizeof(generators[0])) {
+			fprintf(stderr, "unknown generator %s\n", argv[i]);
+			fail = 1;
+		}
+	}
+	return fail;
+}
@@ -0,0 +1,312 @@
+/*
+ * Copyright (c) 2015 Artur Grabowski <art@blahonga.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <math.h>
+#include <assert.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "rX.h"
+#include "rX_sources.h"
+
+/*
+ * numbers_between() in arbitrary_range.c used to count the numbers in
+ * a range with a division that I called a leap of faith, and then
+ * checked it with ten hand picked ranges. This checks it for every
+ * pair of binades instead: every (from exponent, to exponent) pair of
+ * positive doubles, with the mantissas at the edges of the binade (0,
+ * 1, 2, the middle and the top two) and a few random ones.
+ *
+ * That's about 2 million pairs of exponents and 2^27 ranges, split
+ * between all cores. It takes a few seconds on one core.
+ *
+ * The answer was that the leap of faith doesn't hold. When `from`
+ * isn't a multiple of the step, to - from can round, and then the
+ * count is either not an integer (numbers_between(0.3, 0.7) was
+ * 3602879701896396.5 and tripped the assert) or an integer that is
+ * off by one. When `from` is a multiple of the step, the division is
+ * always right. The old division is still checked here to show that.
+ *
+ * Now the count is done in integers by rd_range_count() in rd_range.h
+ * and this checks that it gives us exactly the multiples of step in
+ * [from, to). That can be checked without trusting any of the bit
+ * fiddling, because all the numbers involved are exact:
+ *
+ *  - step is to - nextafter(to, from),
+ *  - start is a multiple of step, start >= from and start - step < from,
+ *  - start + count * step is to.
+ *
+ *	verify_ranges [-r random mantissas] [-t threads] [-s seed]
+ *
+ * Compile with -pthread.
+ */
+
+#include "rd_range.h"
+
+/*
+ * The old numbers_between from arbitrary_range.c, but returning the
+ * count as the double it is computed as instead of asserting that it's
+ * an integer. It counted the numbers from + k * step in [from, to),
+ * which is one more than the multiples of step when from isn't one.
+ */
+static double
+numbers_between_div(double from, double to)
+{
+	double nxt = nextafter(to, from);
+	double step = to - nxt;
+
+	return (to - from) / step;
+}
+
+/*
+ * Returns 0 when rd_range_count got it right.
+ */
+static int
+check_count(double from, double to, uint64_t count, double step, double start)
+{
+	if (step != to - nextafter(to, from))
+		return 1;
+	if (fmod(start, step) != 0 || start < from || start - step >= from)
+		return 1;
+	if (count > (1ULL << 53) || start + (double)count * step != to)
+		return 1;
+	return 0;
+}
+
+struct repro {
+	int found;
+	uint64_t key;
+	double from, to;
+};
+
+/*
+ * The smallest distance between the exponents, then the fewest bits
+ * set in the mantissas, that's the easiest one to reason about.
+ */
+static uint64_t
+repro_key(double from, double to)
+{
+	uint64_t f, t;
+
+	memcpy(&f, &from, sizeof(f));
+	memcpy(&t, &to, sizeof(t));
+	return ((t >> 52) - (f >> 52)) << 32 |
+	    (uint64_t)__builtin_popcountll(f & ((1ULL << 52) - 1)) << 16 |
+	    __builtin_popcountll(t & ((1ULL << 52) - 1)) << 8;
+}
+
+static void
+repro_add(struct repro *r, double from, double to)
+{
+	uint64_t key = repro_key(from, to);
+
+	if (!r->found || key < r->key || (key == r->key && to < r->to)) {
+		r->found = 1;
+		r->key = key;
+		r->from = from;
+		r->to = to;
+	}
+}
+
+struct verify {
+	int nrand;
+	uint32_t key[8];
+	int next;		/* Next from exponent, __atomic_fetch_add. */
+};
+
+struct verify_thread {
+	struct verify *v;
+	pthread_t thr;
+	uint64_t checked, bad, div_bad, div_bad_aligned;
+	struct repro r, div_r;
+} __attribute__((aligned(64)));
+
+static void
+check_one(struct verify_thread *vt, double from, double to)
+{
+	double step, start, div;
+	uint64_t count;
+
+	count = rd_range_count(from, to, &step, &start);
+	vt->checked++;
+	if (check_count(from, to, count, step, start)) {
+		vt->bad++;
+		repro_add(&vt->r, from, to);
+	}
+
+	div = numbers_between_div(from, to);
+	if (div != (double)(count + (start != from))) {
+		vt->div_bad++;
+		if (start == from)
+			vt->div_bad_aligned++;
+		repro_add(&vt->div_r, from, to);
+	}
+}
+
+#define NEDGE 6
+
+static void *
+verify_thread(void *arg)
+{
+	static const uint64_t edge[NEDGE] = {
+		0, 1, 2, 1ULL << 51, (1ULL << 52) - 2, (1ULL << 52) - 1
+	};
+	struct verify_thread *vt = arg;
+	struct verify *v = vt->v;
+	int nm = NEDGE + v->nrand;
+	uint64_t fm[nm], tm[nm];
+	struct rx_chacha c;
+	int fe, te, i, j;
+
+	memcpy(fm, edge, sizeof(edge));
+	memcpy(tm, edge, sizeof(edge));
+	while ((fe = __atomic_fetch_add(&v->next, 1, __ATOMIC_RELAXED)) < 2047) {
+		/* Same random mantissas for a row no matter which thread does it. */
+		rx_chacha_init(&c, v->key, fe, 8);
+		rX_source(rx_chacha_fill, &c);
+		for (te = fe; te < 2047; te++) {
+			for (i = NEDGE; i < nm; i++) {
+				fm[i] = rX(52);
+				tm[i] = rX(52);
+			}
+			for (i = 0; i < nm; i++) {
+				for (j = 0; j < nm; j++) {
+					uint64_t f = (uint64_t)fe << 52 | fm[i];
+					uint64_t t = (uint64_t)te << 52 | tm[j];
+					double from, to;
+
+					if (f >= t)
+						continue;
+					memcpy(&from, &f, sizeof(from));
+					memcpy(&to, &t, sizeof(to));
+					check_one(vt, from, to);
+				}
+			}
+		}
+	}
+	return NULL;
+}
+
+/*
+ * check_count has to agree with the hand checked counts from
+ * test_ranges() in arbitrary_range.c, or none of this means anything.
+ */
+static void
+test_check_count(void)
+{
+	assert(!check_count(0x1p52, 0x1p52 + 3, 3, 1, 0x1p52));
+	assert(!check_count(0x1p55, 0x1p55 + 25, 3, 8, 0x1p55));
+	assert(!check_count(3, 0x1p52 + 1000, (1LL << 52) + 997, 1, 3));
+	assert(!check_count(0, 0x1p53 + 2, (1LL << 52) + 1, 2, 0));
+	assert(!check_count(0, 1, 1LL << 53, 0x1p-53, 0));
+	assert(!check_count(0.3, 0.7, 3602879701896396, 0x1p-53, nextafter(0.3, 1)));
+	assert(check_count(0.3, 0.7, 3602879701896397, 0x1p-53, 0.3));
+	assert(check_count(0, 1, (1LL << 53) - 1, 0x1p-53, 0));
+	assert(check_count(0, 1, 1LL << 52, 0x1p-52, 0));
+	assert(check_count(0x1p-60, 1, 1LL << 53, 0x1p-53, 0));
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int
+main(int argc, char **argv)
+{
+	struct verify v = { 2 };
+	struct verify_thread *vt;
+	struct repro r = { 0 }, div_r = { 0 };
+	uint64_t checked = 0, bad = 0, div_bad = 0, div_bad_aligned = 0, seed = 4711;
+	int nthreads = 0, ch, i;
+	double t, step, start;
+	uint64_t count;
+
+	while ((ch = getopt(argc, argv, "r:s:t:")) != -1) {
+		switch (ch) {
+		case 'r':
+			v.nrand = atoi(optarg);
+			break;
+		case 's':
+			seed = strtoull(optarg, NULL, 0);
+			break;
+		case 't':
+			nthreads = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-r random mantissas] [-t threads] [-s seed]\n",
+			    argv[0]);
+			return 1;
+		}
+	}
+	if (v.nrand < 0)
+		v.nrand = 0;
+	if (nthreads <= 0)
+		nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nthreads < 1)
+		nthreads = 1;
+	v.key[0] = seed;
+	v.key[1] = seed >> 32;
+
+	test_check_count();
+
+	if ((vt = aligned_alloc(64, nthreads * sizeof(*vt))) == NULL)
+		abort();
+	memset(vt, 0, nthreads * sizeof(*vt));
+	t = now();
+	for (i = 0; i < nthreads; i++) {
+		vt[i].v = &v;
+		if (pthread_create(&vt[i].thr, NULL, verify_thread, &vt[i]))
+			abort();
+	}
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(vt[i].thr, NULL);
+		checked += vt[i].checked;
+		bad += vt[i].bad;
+		div_bad += vt[i].div_bad;
+		div_bad_aligned += vt[i].div_bad_aligned;
+		if (vt[i].r.found)
+			repro_add(&r, vt[i].r.from, vt[i].r.to);
+		if (vt[i].div_r.found)
+			repro_add(&div_r, vt[i].div_r.from, vt[i].div_r.to);
+	}
+	t = now() - t;
+	free(vt);
+
+	printf("old division: %" PRIu64 " wrong, %" PRIu64 " of them with from a multiple of the step\n",
+	    div_bad, div_bad_aligned);
+	if (div_r.found)
+		printf("old division: numbers_between(%a, %a) is %.1f\n",
+		    div_r.from, div_r.to, numbers_between_div(div_r.from, div_r.to));
+	printf("rd_range_count: %" PRIu64 " ranges, %" PRIu64 " wrong, %d threads, %.1f s\n",
+	    checked, bad, nthreads, t);
+	if (r.found) {
+		count = rd_range_count(r.from, r.to, &step, &start);
+		printf("rd_range_count(%a, %a): count %" PRIu64 " step %a start %a\n",
+		    r.from, r.to, count, step, start);
+		return 1;
+	}
+	return 0;
+}
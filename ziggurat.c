@@ -0,0 +1,189 @@
+/*
+ * Copyright (c) 2015 Artur Grabowski <art@blahonga.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <math.h>
+#include <assert.h>
+
+#include "rX.h"
+#include "rX_sources.h"
+#include "r0to1.h"
+#include "gof.h"
+#include "ziggurat.h"
+
+/*
+ * Tests for ziggurat.h. bench.cxx measures it next to
+ * std::normal_distribution.
+ */
+
+#define GOF_ALPHA 1e-6
+
+/*
+ * The layers have to be stacked the way the comment in ziggurat.h
+ * says, and the top one, which is whatever is left, has to end up
+ * with the same area as the others.
+ */
+static void
+test_table(const char *name, const struct zig_table *t, double (*f)(double))
+{
+	double v = t->x[0] * f(t->r), fast = 0;
+	int i;
+
+	assert(t->x[1] == t->r && t->x[0] > t->r);
+	for (i = 1; i < ZIG_LAYERS; i++) {
+		assert(t->x[i] > t->x[i + 1] && t->f[i] < t->f[i + 1]);
+		assert(fabs(t->x[i] * (t->f[i + 1] - t->f[i]) / v - 1) < 1e-12);
+	}
+	for (i = 0; i < ZIG_LAYERS; i++)
+		fast += t->x[i + 1] / t->x[i];
+	printf("%s: %.2f%% of the words are done without the slow path\n",
+	    name, 100 * fast / ZIG_LAYERS);
+}
+
+/*
+ * Same as check_fill in rd.c: the bulk version from the same bits,
+ * at all kinds of offsets in the buffer, gives exactly the same
+ * numbers as one at a time.
+ */
+static void
+check_fill_kernel(zig_kernel kernel, const char *kname, const struct zig_table *t,
+    double (*one)(void), const char *name)
+{
+	static double a[10007];
+	const uint32_t key[8] = { 0x7a, 0x69, 0x67 };
+	struct rx_chacha c;
+	size_t n, i;
+
+	for (n = 1; n < 10007; n = n * 3 + 1) {
+		rx_chacha_init(&c, key, n, 8);
+		rX_source(rx_chacha_fill, &c);
+		rX(n % 64 + 1);
+		zig_fill_kernel(kernel, t, one, a, n);
+		rx_chacha_init(&c, key, n, 8);
+		rX_source(rx_chacha_fill, &c);
+		rX(n % 64 + 1);
+		for (i = 0; i < n; i++) {
+			double b = one();
+
+			if (memcmp(&a[i], &b, sizeof(b))) {
+				printf("%s fill(%s)[%zu]: %a, one at a time: %a\n",
+				    name, kname, i, a[i], b);
+				abort();
+			}
+		}
+	}
+	rX_source(rx_arc4random_fill, NULL);
+}
+
+static void
+check_fill(const struct zig_table *t, double (*one)(void), const char *name)
+{
+	check_fill_kernel(zig_kernel_scalar, "scalar", t, one, name);
+#if defined(__x86_64__) && defined(__GNUC__)
+	if (__builtin_cpu_supports("avx2"))
+		check_fill_kernel(zig_kernel_avx2, "avx2", t, one, name);
+	if (__builtin_cpu_supports("avx512f"))
+		check_fill_kernel(zig_kernel_avx512, "avx512", t, one, name);
+#endif
+}
+
+static double
+normal_cdf(double x)
+{
+	return 0.5 * erfc(-x / sqrt(2.0));
+}
+
+static double
+exp_cdf(double x)
+{
+	return -expm1(-x);
+}
+
+/*
+ * The cdf of the numbers should be uniform in [0,1), which gof.h can
+ * check. The tail has too few numbers to make a difference to that, so
+ * it gets its own test: how many numbers are past r, and past r + 1
+ * given that they're past r.
+ */
+static void
+test_dist(const char *name, void (*fill)(double *, size_t), double (*cdf)(double),
+    double r, int sym)
+{
+	const uint64_t n = 1 << 24;
+	double buf[GOF_BATCH], c[GOF_BATCH], chi, chip, d, ksp, z, p, pt;
+	uint64_t i, tail = 0, far = 0;
+	struct gof_hist h;
+	int j;
+
+	gof_hist_init(&h, 0, 1, 1000);
+	for (i = 0; i < n; i += GOF_BATCH) {
+		fill(buf, GOF_BATCH);
+		for (j = 0; j < GOF_BATCH; j++) {
+			assert(isfinite(buf[j]) && (sym || buf[j] >= 0));
+			c[j] = cdf(buf[j]);
+			tail += fabs(buf[j]) >= r;
+			far += fabs(buf[j]) >= r + 1;
+		}
+		gof_hist_add(&h, c, GOF_BATCH);
+	}
+	chip = gof_chisq(&h, &chi);
+	ksp = gof_ks(&h, &d);
+	printf("%s: chi-square %.1f p %.3g, KS D %.3g p %.3g\n", name, chi, chip, d, ksp);
+	if (chip < GOF_ALPHA || ksp < GOF_ALPHA)
+		printf("%s: wrong distribution\n", name);
+
+	pt = (1 - cdf(r)) * (sym ? 2 : 1);
+	p = gof_binomial_p(tail, n, pt, &z);
+	printf("%s: %" PRIu64 " past %g, expected %.0f, p %.3g\n", name, tail, r, n * pt, p);
+	if (p < GOF_ALPHA)
+		printf("%s: wrong tail\n", name);
+	p = gof_binomial_p(far, tail, (1 - cdf(r + 1)) / (1 - cdf(r)), &z);
+	printf("%s: %" PRIu64 " of them past %g, p %.3g\n", name, far, r + 1, p);
+	if (p < GOF_ALPHA)
+		printf("%s: wrong tail shape\n", name);
+	gof_hist_free(&h);
+}
+
+static void
+normal_one_at_a_time(double *out, size_t n)
+{
+	while (n--)
+		*out++ = rd_normal();
+}
+
+static void
+exp_one_at_a_time(double *out, size_t n)
+{
+	while (n--)
+		*out++ = rd_exponential();
+}
+
+int
+main(int argc, char **argv)
+{
+	test_table("normal", &zig_normal_tab, zig_normal_f);
+	test_table("exponential", &zig_exp_tab, zig_exp_f);
+	check_fill(&zig_normal_tab, rd_normal, "rd_normal");
+	check_fill(&zig_exp_tab, rd_exponential, "rd_exponential");
+	test_dist("rd_normal", normal_one_at_a_time, normal_cdf, zig_normal_tab.r, 1);
+	test_dist("rd_normal_fill", rd_normal_fill, normal_cdf, zig_normal_tab.r, 1);
+	test_dist("rd_exponential", exp_one_at_a_time, exp_cdf, zig_exp_tab.r, 0);
+	test_dist("rd_exponential_fill", rd_exponential_fill, exp_cdf, zig_exp_tab.r, 0);
+	return 0;
+}
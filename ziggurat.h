@@ -0,0 +1,419 @@
+/*
+ * Copyright (c) 2015 Artur Grabowski <art@blahonga.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef ZIGGURAT_H
+#define ZIGGURAT_H
+
+#include <stddef.h>
+#include <inttypes.h>
+#include <math.h>
+
+#include "rX.h"
+#include "r0to1.h"
+
+/*
+ * Normal and exponential numbers with Marsaglia and Tsang's ziggurat.
+ *
+ * The usual way to get a normal number out of uniform ones is
+ * Box-Muller, which is a log, a square root and a sine or cosine per
+ * two numbers. The ziggurat covers the density with 256 layers of
+ * equal area, all rectangles except the bottom one, which is a
+ * rectangle plus the tail. Pick a layer and a point in it, and almost
+ * always (98.5% for the normal, 97.8% for the exponential) the point
+ * is in the part of the layer that's entirely under the curve. Then
+ * the number is just a multiplication.
+ *
+ * All of that comes from one rX(64): the low 8 bits are the layer,
+ * the next bit is the sign (for the normal) and the top 52 bits are
+ * the mantissa of a double in [1,2), from which the point in the layer
+ * is u * x[i] with u in [0,1). The sign is put in by or:ing in the
+ * bit, no branches.
+ *
+ * The rest of the time the point is either in the tail or in the
+ * wedge of a layer that sticks out over the curve. Those need a
+ * uniform number with more precision than the 52 bits, especially the
+ * tail where the logarithm of a number close to 0 decides how far out
+ * we go, so they take r0to1b from rd.c (r0to1b_bits in r0to1.h). A
+ * point in a wedge that's over the curve is rejected and we start
+ * over with a new word.
+ *
+ * The bulk versions do the common case for 4 (AVX2) or 8 (AVX-512)
+ * words at a time with gathers from the tables, and stop at the first
+ * word that needs the tail or the wedge, which then goes through the
+ * scalar code. So they give exactly the same numbers as calling
+ * rd_normal or rd_exponential n times.
+ */
+
+#define ZIG_LAYERS 256
+
+struct zig_table {
+	double x[ZIG_LAYERS + 1];	/* x[i] is the width of layer i, x[0] of the base rectangle. */
+	double f[ZIG_LAYERS + 1];	/* f(x[i]) */
+	double r;			/* Where the tail starts. */
+	uint64_t sign;			/* Where the sign bit goes, 0 for the exponential. */
+};
+
+static struct zig_table zig_normal_tab, zig_exp_tab;
+
+static inline double
+zig_normal_f(double x)
+{
+	return exp(-0.5 * x * x);
+}
+
+static inline double
+zig_normal_finv(double y)
+{
+	return sqrt(-2.0 * log(y));
+}
+
+static inline double
+zig_exp_f(double x)
+{
+	return exp(-x);
+}
+
+static inline double
+zig_exp_finv(double y)
+{
+	return -log(y);
+}
+
+/*
+ * Every layer has the area v. The bottom one is the rectangle under
+ * f(r) plus the tail, so v is r * f(r) plus the area of the tail, its
+ * width is v / f(r) and a point in it that is further out than r is
+ * a point in the tail. The others are stacked on top: the layer on top
+ * of x[i] is as high as it needs to be to have the area v with the
+ * width x[i], and then its top edge hits the curve at x[i + 1]. r is
+ * from Marsaglia and Tsang, it's what makes the top layer end at 0.
+ */
+static inline void
+zig_table_init(struct zig_table *t, double r, double tail, double (*f)(double),
+    double (*finv)(double), uint64_t sign)
+{
+	double v = r * f(r) + tail;
+	int i;
+
+	t->r = r;
+	t->sign = sign;
+	t->x[0] = v / f(r);
+	t->f[0] = 0;
+	t->x[1] = r;
+	t->f[1] = f(r);
+	for (i = 2; i < ZIG_LAYERS; i++) {
+		t->x[i] = finv(v / t->x[i - 1] + t->f[i - 1]);
+		t->f[i] = f(t->x[i]);
+	}
+	t->x[ZIG_LAYERS] = 0;
+	t->f[ZIG_LAYERS] = 1;
+}
+
+__attribute__((constructor))
+static void
+zig_init(void)
+{
+	const double rn = 3.6541528853610088, re = 7.69711747013104972;
+
+	zig_table_init(&zig_normal_tab, rn, sqrt(M_PI / 2) * erfc(rn / sqrt(2.0)),
+	    zig_normal_f, zig_normal_finv, 1ULL << 63);
+	zig_table_init(&zig_exp_tab, re, exp(-re), zig_exp_f, zig_exp_finv, 0);
+}
+
+/*
+ * The common case. *out is the number if it returns 1, if it returns
+ * 0 it's the point in the layer for the slow path.
+ */
+static inline int
+zig_fast(const struct zig_table *t, uint64_t r, double *out)
+{
+	union {
+		uint64_t u;
+		double d;
+	} b;
+	unsigned i = r & 0xff;
+	double x;
+
+	b.u = 0x3ff0000000000000ULL | r >> 12;
+	x = (b.d - 1.0) * t->x[i];
+	b.d = x;
+	b.u |= (r << 55) & t->sign;
+	*out = b.d;
+	return x < t->x[i + 1];
+}
+
+/*
+ * A uniform number in (0,1) for the logarithms.
+ */
+static inline double
+zig_u(void)
+{
+	double u;
+
+	while ((u = r0to1b_bits(rX(53))) == 0.0)
+		;
+	return u;
+}
+
+/*
+ * The wedge of layer i: pick the height of the point between the
+ * bottom and the top of the layer and see if it's under the curve.
+ */
+static inline int
+zig_wedge(const struct zig_table *t, unsigned i, double fx)
+{
+	double y = t->f[i] + r0to1b_bits(rX(53)) * (t->f[i + 1] - t->f[i]);
+
+	if (y < fx)
+		return 1;
+	RX_STAT_ADD(rejections, 1);
+	return 0;
+}
+
+/*
+ * The tail of the normal is Marsaglia's method from 1964.
+ */
+static inline int
+zig_normal_slow(uint64_t r, double *out)
+{
+	const struct zig_table *t = &zig_normal_tab;
+	unsigned i = r & 0xff;
+	double x = fabs(*out), y;
+
+	if (i == 0) {
+		do {
+			x = -log(zig_u()) / t->r;
+			y = -log(zig_u());
+		} while (y + y < x * x);
+		x += t->r;
+	} else if (!zig_wedge(t, i, zig_normal_f(x))) {
+		return 0;
+	}
+	*out = (r >> 8) & 1 ? -x : x;
+	return 1;
+}
+
+/*
+ * The exponential doesn't remember how far out it is, so the tail is
+ * just r plus another exponential number.
+ */
+static inline int
+zig_exp_slow(uint64_t r, double *out)
+{
+	const struct zig_table *t = &zig_exp_tab;
+	unsigned i = r & 0xff;
+
+	if (i == 0) {
+		*out = t->r - log(zig_u());
+		return 1;
+	}
+	return zig_wedge(t, i, zig_exp_f(*out));
+}
+
+static inline double
+rd_normal(void)
+{
+	double d;
+	uint64_t r;
+
+	do {
+		r = rX(64);
+	} while (!zig_fast(&zig_normal_tab, r, &d) && !zig_normal_slow(r, &d));
+	return d;
+}
+
+static inline double
+rd_exponential(void)
+{
+	double d;
+	uint64_t r;
+
+	do {
+		r = rX(64);
+	} while (!zig_fast(&zig_exp_tab, r, &d) && !zig_exp_slow(r, &d));
+	return d;
+}
+
+/*
+ * The kernels do the common case for at most n numbers from the k
+ * words starting at bit `pos` of `buf`, and stop at the first word
+ * that needs the slow path. They return how many numbers (and words)
+ * they did.
+ */
+typedef size_t (*zig_kernel)(double *, size_t, const struct zig_table *,
+    const uint64_t *, uint64_t, size_t);
+
+static inline size_t
+zig_kernel_scalar(double *out, size_t n, const struct zig_table *t,
+    const uint64_t *buf, uint64_t pos, size_t k)
+{
+	const uint64_t *b = buf + (pos >> 6);
+	unsigned off = pos & 63;
+	size_t i;
+
+	for (i = 0; i < k && i < n; i++) {
+		uint64_t r = off ? (b[i] >> off) | (b[i + 1] << (64 - off)) : b[i];
+
+		if (!zig_fast(t, r, &out[i]))
+			break;
+	}
+	return i;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+
+__attribute__((target("avx2")))
+static inline size_t
+zig_kernel_avx2(double *out, size_t n, const struct zig_table *t,
+    const uint64_t *buf, uint64_t pos, size_t k)
+{
+	const uint64_t *b = buf + (pos >> 6);
+	const __m128i sr = _mm_cvtsi32_si128(pos & 63);
+	const __m128i sl = _mm_cvtsi32_si128(64 - (pos & 63));	/* 64 shifts in zeroes. */
+	const __m256i one = _mm256_set1_epi64x(0x3ff0000000000000ULL);
+	const __m256i sign = _mm256_set1_epi64x(t->sign);
+	const __m256i lane = _mm256_setr_epi64x(0, 1, 2, 3);
+	const __m256d fone = _mm256_set1_pd(1.0);
+	size_t i;
+
+	for (i = 0; i + 4 <= k && n - i >= 4; ) {
+		__m256i r, idx, s, keep;
+		__m256d xi, xn, x, res;
+		int good;
+
+		r = _mm256_or_si256(
+		    _mm256_srl_epi64(_mm256_loadu_si256((const __m256i *)(b + i)), sr),
+		    _mm256_sll_epi64(_mm256_loadu_si256((const __m256i *)(b + i + 1)), sl));
+		idx = _mm256_and_si256(r, _mm256_set1_epi64x(0xff));
+		xi = _mm256_i64gather_pd(t->x, idx, 8);
+		xn = _mm256_i64gather_pd(t->x + 1, idx, 8);
+		x = _mm256_mul_pd(_mm256_sub_pd(_mm256_castsi256_pd(_mm256_or_si256(one,
+		    _mm256_srli_epi64(r, 12))), fone), xi);
+		s = _mm256_and_si256(_mm256_slli_epi64(r, 55), sign);
+		res = _mm256_castsi256_pd(_mm256_or_si256(_mm256_castpd_si256(x), s));
+		good = __builtin_ctz(~_mm256_movemask_pd(_mm256_cmp_pd(x, xn, _CMP_LT_OQ)));
+		keep = _mm256_cmpgt_epi64(_mm256_set1_epi64x(good), lane);
+		_mm256_maskstore_pd(out + i, keep, res);
+		i += good;
+		if (good < 4)
+			return i;
+	}
+	return i + zig_kernel_scalar(out + i, n - i, t, buf, pos + i * 64, k - i);
+}
+
+__attribute__((target("avx512f")))
+static inline size_t
+zig_kernel_avx512(double *out, size_t n, const struct zig_table *t,
+    const uint64_t *buf, uint64_t pos, size_t k)
+{
+	const uint64_t *b = buf + (pos >> 6);
+	const __m128i sr = _mm_cvtsi32_si128(pos & 63);
+	const __m128i sl = _mm_cvtsi32_si128(64 - (pos & 63));	/* 64 shifts in zeroes. */
+	const __m512i one = _mm512_set1_epi64(0x3ff0000000000000ULL);
+	const __m512i sign = _mm512_set1_epi64(t->sign);
+	const __m512d fone = _mm512_set1_pd(1.0);
+	size_t i;
+
+	for (i = 0; i + 8 <= k && n - i >= 8; ) {
+		__m512i r, idx, s;
+		__m512d xi, xn, x, res;
+		int good;
+
+		r = _mm512_or_si512(_mm512_srl_epi64(_mm512_loadu_si512(b + i), sr),
+		    _mm512_sll_epi64(_mm512_loadu_si512(b + i + 1), sl));
+		idx = _mm512_and_si512(r, _mm512_set1_epi64(0xff));
+		xi = _mm512_i64gather_pd(idx, t->x, 8);
+		xn = _mm512_i64gather_pd(idx, t->x + 1, 8);
+		x = _mm512_mul_pd(_mm512_sub_pd(_mm512_castsi512_pd(_mm512_or_si512(one,
+		    _mm512_srli_epi64(r, 12))), fone), xi);
+		s = _mm512_and_si512(_mm512_slli_epi64(r, 55), sign);
+		res = _mm512_castsi512_pd(_mm512_or_si512(_mm512_castpd_si512(x), s));
+		good = __builtin_ctz(~(unsigned)_mm512_cmp_pd_mask(x, xn, _CMP_LT_OQ));
+		_mm512_mask_storeu_pd(out + i, (__mmask8)((1U << good) - 1), res);
+		i += good;
+		if (good < 8)
+			return i;
+	}
+	return i + zig_kernel_scalar(out + i, n - i, t, buf, pos + i * 64, k - i);
+}
+#endif
+
+/*
+ * Whenever the kernel stops, for the slow path or because the next
+ * word straddles a refill, one number is done by `one`, which is
+ * what would have happened if we called it all along.
+ */
+static inline void
+zig_fill_kernel(zig_kernel kernel, const struct zig_table *t, double (*one)(void),
+    double *out, size_t n)
+{
+	while (n) {
+		size_t k = (RX_BITS - rx_res.pos) / 64, got;
+
+		if (k) {
+			got = kernel(out, n, t, rx_res.buf, rx_res.pos, k);
+			rx_res.pos += got * 64;
+			out += got;
+			n -= got;
+		}
+		if (n) {
+			*out++ = one();
+			n--;
+		}
+	}
+}
+
+static inline zig_kernel
+zig_best_kernel(void)
+{
+#if defined(__x86_64__) && defined(__GNUC__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f"))
+		return zig_kernel_avx512;
+	if (__builtin_cpu_supports("avx2"))
+		return zig_kernel_avx2;
+#endif
+	return zig_kernel_scalar;
+}
+
+static inline void
+rd_normal_fill(double *out, size_t n)
+{
+	static zig_kernel best;
+	zig_kernel kernel = __atomic_load_n(&best, __ATOMIC_RELAXED);
+
+	if (kernel == NULL) {
+		kernel = zig_best_kernel();
+		__atomic_store_n(&best, kernel, __ATOMIC_RELAXED);
+	}
+	zig_fill_kernel(kernel, &zig_normal_tab, rd_normal, out, n);
+}
+
+static inline void
+rd_exponential_fill(double *out, size_t n)
+{
+	static zig_kernel best;
+	zig_kernel kernel = __atomic_load_n(&best, __ATOMIC_RELAXED);
+
+	if (kernel == NULL) {
+		kernel = zig_best_kernel();
+		__atomic_store_n(&best, kernel, __ATOMIC_RELAXED);
+	}
+	zig_fill_kernel(kernel, &zig_exp_tab, rd_exponential, out, n);
+}
+
+#endif /* ZIGGURAT_H */